@@ -1,44 +1,347 @@
 #pragma once
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
-#define ALIGNMENT 8
+// every pointer handed out is aligned to this (alignof(max_align_t))
+#define ALIGNMENT 16
 #define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
 
+// size classes for the segregated free lists: 16, 32, 64 ... 128K and above
+#define NUM_BINS 14
+#define MIN_BIN_SIZE 16
+
+// requests at or above the mmap threshold get their own mapping
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+
+// bigger requests fail with ENOMEM, adding headers and alignment to a size
+// up to this never wraps around
+#define MAX_REQUEST ((size_t)PTRDIFF_MAX)
+
+// free pages untouched for this long are returned to the OS
+#define DEFAULT_PURGE_DECAY_MS 1000
+
+// _mallopt(MEM_OPT_DEFER_COALESCE, 1) parks freed blocks unmerged, up to
+// QUICK_MAX per arena
+#define DEFAULT_DEFER_COALESCE 0
+#define QUICK_MAX 64
+
+// parameters for _mallopt
+#define MEM_OPT_MMAP_THRESHOLD 1
+#define MEM_OPT_PURGE_DECAY_MS 2 // milliseconds, 0 = at once, -1 = never
+#define MEM_OPT_DEFER_COALESCE 3 // 0 = coalesce on every free, 1 = batch
+#define MEM_OPT_FIT_STRATEGY 4   // MEM_FIT_*, only before the first allocation
+#define MEM_OPT_HUGE_PAGES 5     // MEM_HUGE_*, only before the first allocation
+
+// how free blocks are indexed: power-of-two bins searched first-fit, or a
+// TLSF (two-level segregated fit) index answering every request in O(1).
+// Build with -DDEFAULT_FIT_STRATEGY=MEM_FIT_TLSF to make TLSF the default.
+#define MEM_FIT_SEGREGATED 0
+#define MEM_FIT_TLSF 1
+#ifndef DEFAULT_FIT_STRATEGY
+#define DEFAULT_FIT_STRATEGY MEM_FIT_SEGREGATED
+#endif
+
+// huge page backing of the heap regions: none, transparent huge pages (regions
+// 2 MB aligned and MADV_HUGEPAGE) or MAP_HUGETLB pages from the reserved pool,
+// which fall back to transparent ones once the pool is empty. Either huge mode
+// commits and purges heap memory in whole huge pages.
+#define MEM_HUGE_OFF 0
+#define MEM_HUGE_THP 1
+#define MEM_HUGE_HUGETLB 2
+#ifndef DEFAULT_HUGE_PAGES
+#define DEFAULT_HUGE_PAGES MEM_HUGE_OFF
+#endif
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define HUGETLB_RESERVE_SIZE ((size_t)64 << 20) // pool taken per region at most
+
+// TLSF: one first level per power of two, split into TLSF_SL equal classes.
+// Sizes below TLSF_LINEAR all go to first level 0 in ALIGNMENT wide classes.
+#define TLSF_SL_LOG 4
+#define TLSF_SL (1 << TLSF_SL_LOG)
+#define TLSF_LINEAR (ALIGNMENT << TLSF_SL_LOG)
+#define TLSF_FL (64 - 8 + 1) // level 0, then log2(size) = 8 ... 63
+
+// operations timed by the latency histograms (built with -DMEM_LATENCY)
+#define MEM_LAT_MALLOC 0
+#define MEM_LAT_FREE 1
+#define MEM_LAT_CALLOC 2
+#define MEM_LAT_REALLOC 3
+#define MEM_LAT_OPS 4
+
+// every arena reserves address space up front and commits it as it grows,
+// a new reservation is only needed once this much is used
+#define HEAP_RESERVE_SIZE ((size_t)4 << 30)
+#define HEAP_COMMIT_STEP (64 * 1024)
+
+// objects up to SLAB_MAX_SIZE bytes are packed into header-less slab pages
+#define SLAB_MAX_SIZE 64
+#define SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_CHUNK_SIZE (16 * SLAB_PAGE_SIZE) // committed at a time
+#define SLAB_RESERVE_SIZE ((size_t)4 << 30)
+#define SLAB_MAP_WORDS (SLAB_PAGE_SIZE / ALIGNMENT / 64)
+#define SLAB_MAGIC 0x51AB51AB
+
+// regions bump-allocate from chunks of their own mapping, each chunk twice
+// the size of the last up to REGION_MAX_CHUNK. Bigger requests get a chunk
+// of their own.
+#define REGION_MIN_CHUNK (64 * 1024)
+#define REGION_MAX_CHUNK ((size_t)4 << 20)
+
+// pools carve their objects from chunks sized like a region's. Each of the
+// first POOL_MAX_THREADS threads caches up to POOL_CACHE_MAX free objects per
+// pool and moves POOL_BATCH at a time to and from the shared list.
+#define POOL_MAX_THREADS 64
+#define POOL_CACHE_MAX 64
+#define POOL_BATCH 32
+
+// upper bound on arenas, the actual count defaults to the number of CPUs
+#define MAX_ARENAS 64
+#define NO_ARENA UINT32_MAX // arena_id of blocks with their own mapping
+
+// flag bits kept in the low bits of block_header.size (sizes are aligned)
+#define BLOCK_FREE 1      // block is in a free list
+#define BLOCK_PREV_FREE 2 // physically previous block is free (has a footer)
+#define BLOCK_CACHED 4    // block sits in a thread cache
+#define BLOCK_FLAGS (BLOCK_FREE | BLOCK_PREV_FREE | BLOCK_CACHED)
+
 extern const int MIN_HEADER_SIZE;
 extern const size_t BLOCK_MAGIC;
 extern const size_t ALIGNED_BLOCK_SIZE;
 
 // header with metadata for the memory block
+// Physical neighbours are found by address: the next block starts right
+// after the payload, the previous one through the footer (a copy of its
+// size in its last payload word) which only free blocks carry.
 typedef struct block_header
 {
-	size_t size;
-	bool is_free;
-	size_t magic;
+	size_t size;       // payload bytes | BLOCK_* flags
+	uint32_t magic;    // low 32 bits of BLOCK_MAGIC
+	uint32_t arena_id; // index into arenas[] or NO_ARENA
 
-	struct block_header *prev;
-	struct block_header *prev_free;
-	struct block_header *next;
+} block_header;
+
+// overlaid on the payload of a free block
+typedef struct free_links
+{
 	struct block_header *next_free;
+	struct block_header *prev_free;
+	uint64_t freed_at; // decay clock, only kept on blocks spanning a page
 
-} block_header;
+} free_links;
+
+// address space reserved by an arena: this header, then blocks, then an
+// allocated zero-size block (the epilogue) that stops walks and coalescing.
+// Only the first size bytes are committed, the rest is PROT_NONE.
+typedef struct heap_region
+{
+	// padded so the blocks after it stay ALIGNMENT aligned
+	_Alignas(ALIGNMENT) struct heap_region *next;
+	size_t size;     // bytes committed, including this header
+	size_t reserved; // bytes of address space reserved
+} heap_region;
+
+// header at the start of every slab page, the slots follow it
+typedef struct slab
+{
+	uint32_t magic; // SLAB_MAGIC while the page serves a size class
+	uint32_t arena_id;
+	uint32_t obj_size;
+	uint32_t capacity;   // slots in this page
+	uint32_t free_count; // free slots left
+	struct slab *next;   // partial list of its class, or free page list
+	struct slab *prev;
+	uint64_t freed_at; // ms timestamp it became an empty page
+	uint64_t free_map[SLAB_MAP_WORDS]; // bit set <=> slot is free
+} slab;
+
+// futex based lock, all zero is unlocked
+typedef struct mem_lock
+{
+	uint32_t state; // 0 free, 1 held, 2 held with possible sleepers
+} mem_lock;
+
+// an independent heap: its regions, size-class free lists and a lock
+typedef struct arena
+{
+	mem_lock lock;
+	heap_region *regions; // newest first, the head is the one that grows
+	struct block_header *free_lists[NUM_BINS];
+	unsigned int bin_map; // bit i set <=> free_lists[i] is non-empty
+	struct block_header *tlsf_lists[TLSF_FL][TLSF_SL]; // with MEM_FIT_TLSF
+	uint64_t tlsf_fl_map;          // bit i set <=> tlsf_sl_map[i] != 0
+	uint32_t tlsf_sl_map[TLSF_FL]; // bit j set <=> tlsf_lists[i][j] non-empty
+	int num_threads;      // threads currently attached
+	int node;             // NUMA node its memory is bound to, see initArenas
+	uint64_t last_purge;  // ms timestamp of the last purge pass
+	slab *slabs[SLAB_CLASSES]; // slabs with at least one free slot
+	slab *slab_pages;          // empty pages ready for any class
+	void *remote_frees; // freed by other threads, linked through the objects
+	struct block_header *quick[NUM_BINS]; // parked blocks, see heapFree
+	unsigned int quick_count;
+
+	// statistics, see _mallinfo
+	size_t in_use;      // payload handed out, thread caches included
+	size_t peak_in_use; // high-water mark of in_use
+	size_t free_bytes;  // payload of the blocks in the free lists
+	size_t free_blocks[NUM_BINS];
+} arena;
+
+// heap statistics returned by _mallinfo
+typedef struct mem_stats
+{
+	size_t mapped;      // bytes committed from the OS: heaps, slabs, mappings
+	size_t in_use;      // bytes handed out, blocks in thread caches included
+	size_t peak_in_use; // high-water mark of in_use, summed over arenas so
+	                    // an upper bound when several arenas are busy
+	size_t free_blocks; // blocks in the free lists
+	size_t free_bytes;  // their payload
+	size_t largest_free;
+	size_t bin_blocks[NUM_BINS]; // free blocks per size class
+	double fragmentation;        // 1 - largest_free / free_bytes
+} mem_stats;
+
+// bump allocator whose objects are all released together, see _region_alloc
+typedef struct mem_region
+{
+	struct region_chunk *chunks; // newest first, the head is bumped
+	char *top;                   // next free byte of the head chunk
+	char *end;
+	size_t chunk_size; // payload of the last regular chunk
+} mem_region;
+
+// free objects of a pool owned by one thread, a cache line each
+typedef struct pool_cache
+{
+	_Alignas(64) void *head; // linked through the first word of each object
+	unsigned int count;
+} pool_cache;
+
+// fixed-size objects without headers, see _pool_alloc
+typedef struct mem_pool
+{
+	mem_lock lock;     // guards everything but the caches
+	size_t obj_size;   // slot stride: the size rounded up to align
+	size_t align;
+	void *free_list;   // shared free objects
+	char *top;         // next uncarved slot of the newest chunk
+	char *end;
+	struct region_chunk *chunks; // newest first
+	size_t chunk_size;
+	struct mem_pool *next; // every live pool, for the fork handlers
+	struct mem_pool *prev;
+	pool_cache caches[POOL_MAX_THREADS];
+} mem_pool;
+
+// latency of one operation over all threads, returned by _latency
+typedef struct mem_latency
+{
+	uint64_t count; // calls timed, 0 without MEM_LATENCY
+	double mean_ns;
+	uint64_t max_ns;
+	uint64_t p50_ns; // percentiles are accurate to 1/16
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+	uint64_t p9999_ns;
+} mem_latency;
+
+// the public API below is all the preload library exports, it is built with
+// -fvisibility=hidden so the internals cannot interpose the host's symbols
+#define MEM_EXPORT __attribute__((visibility("default")))
+
+extern arena arenas[MAX_ARENAS];
+extern int num_arenas;
 
 // create a new page and initialize a header and return it
 struct block_header *getHeap(size_t size);
 
-void initHeap(void);
-void expandHeap(size_t min_size);
+// both return false if the system is out of memory
+bool initHeap(arena *ar);
+bool expandHeap(arena *ar, size_t min_size);
+
+struct block_header *coalesce(arena *ar, struct block_header *current);
 
-void coalesce(struct block_header *current);
+int getBinIndex(size_t size);
+void addToFreeList(arena *ar, struct block_header *block);
+void removeFromFreeList(arena *ar, struct block_header *block);
+struct block_header *findFreeBlock(arena *ar, size_t length);
 
 void validate_list(void);
 
-void *_malloc(size_t length);
-void _free(void *data);
-void *_calloc(size_t num, size_t size);
-void *_realloc(void *ptr, size_t size);
+// arena primitives behind the per-thread caches, the caller holds the lock
+// of the arena involved (for the slab functions below as well)
+void *heapMalloc(arena *ar, size_t length);
+void heapFree(struct block_header *current);
+void *heapMemalign(arena *ar, size_t alignment, size_t length);
+void *heapCalloc(arena *ar, size_t length, size_t *clean_from,
+                 size_t *clean_to);
+bool heapGrow(arena *ar, struct block_header *block, size_t length);
+
+// release idle free pages of an arena back to the OS
+void purgeBlock(struct block_header *block);
+void purgeArena(arena *ar, uint64_t now);
+void flushQuick(arena *ar);
+
+// header-less slabs for tiny objects
+void *slabMalloc(arena *ar, size_t size);
+void slabFree(void *ptr);
+
+// lock-free frees from threads of other arenas, drained by the owner while
+// it holds its lock
+void remoteFree(arena *ar, void *ptr);
+void drainRemoteFrees(arena *ar);
+
+// large blocks with their own mapping
+void *mmapMalloc(size_t length);
+void mmapFree(struct block_header *block);
+struct block_header *mmapRealloc(struct block_header *block, size_t length);
+void *mmapMemalign(size_t alignment, size_t length);
+
+MEM_EXPORT void *_malloc(size_t length);
+MEM_EXPORT void _free(void *data);
+MEM_EXPORT void *_calloc(size_t num, size_t size);
+MEM_EXPORT void *_realloc(void *ptr, size_t size);
+
+// alignment must be a power of two (_aligned_alloc) that is also a multiple
+// of sizeof(void *) (_posix_memalign), _memalign rounds it up to one
+MEM_EXPORT void *_aligned_alloc(size_t alignment, size_t size);
+MEM_EXPORT int _posix_memalign(void **memptr, size_t alignment,
+                               size_t size);
+MEM_EXPORT void *_memalign(size_t alignment, size_t size);
+
+MEM_EXPORT size_t _malloc_usable_size(void *ptr);
+
+MEM_EXPORT mem_stats _mallinfo(void);
+
+// regions: ALIGNMENT aligned objects carved off by bumping a pointer, with no
+// header and no _free. _region_reset releases all of them at once, keeping
+// the current chunk for reuse, _region_destroy returns everything. A region
+// must only be used by one thread at a time.
+MEM_EXPORT mem_region *_region_create(void);
+MEM_EXPORT void *_region_alloc(mem_region *region, size_t size);
+MEM_EXPORT void _region_reset(mem_region *region);
+MEM_EXPORT void _region_destroy(mem_region *region);
+
+// pools: O(1) alloc and free of obj_size objects aligned to align, packed
+// back to back with no header. Pools are thread-safe and free objects are
+// cached per thread, _pool_destroy releases every object at once.
+MEM_EXPORT mem_pool *_pool_create(size_t obj_size, size_t align);
+MEM_EXPORT void *_pool_alloc(mem_pool *pool);
+MEM_EXPORT void _pool_free(mem_pool *pool, void *obj);
+MEM_EXPORT void _pool_destroy(mem_pool *pool);
+
+// per-operation latency histograms, only filled when built with MEM_LATENCY
+MEM_EXPORT mem_latency _latency(int op); // op is MEM_LAT_*
+MEM_EXPORT void _latency_print(FILE *out);
+MEM_EXPORT void _latency_reset(void);
+
+// set an allocator parameter (MEM_OPT_*), returns 1 on success and 0 on error
+MEM_EXPORT int _mallopt(int param, int value);
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+
+// Allocation traces, written by the preload library when MEM_TRACE names a
+// file and read back by the replay tool:
+//
+//   MEM_TRACE=app.trace LD_PRELOAD=./build/libmem_alloc.so ./app
+//   ./build/replay app.trace
+//
+// The file is a trace_header followed by fixed-size trace_records in the
+// order the calls completed. Calls are serialized while tracing, so a block
+// is always freed after the record that returned it.
+
+#define TRACE_MAGIC 0x4543415254454D4DULL // "MEMTRACE"
+#define TRACE_VERSION 1
+
+// trace_record.op
+#define TRACE_MALLOC 1
+#define TRACE_FREE 2
+#define TRACE_CALLOC 3   // size is num * size
+#define TRACE_REALLOC 4  // arg is the old pointer
+#define TRACE_MEMALIGN 5 // arg is the alignment
+
+typedef struct trace_header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size; // sizeof(trace_record) of the writer
+} trace_header;
+
+typedef struct trace_record
+{
+	uint64_t time_ns; // since the trace was opened
+	uint64_t arg;     // pointer freed or resized, or the alignment
+	uint64_t size;    // bytes requested
+	uint64_t result;  // pointer returned, 0 on failure or for free
+	uint32_t tid;     // kernel thread id of the caller
+	uint32_t op;      // TRACE_*
+} trace_record;
@@ -0,0 +1,358 @@
+// Scalability benchmark: sweeps 1..N threads over several workload shapes and
+// reports throughput and speedup over one thread for _malloc and the system
+// malloc side by side.
+//
+// usage: bench_threads [max_threads] [ops_per_thread]
+//
+// Every thread does the same number of operations whatever the thread count,
+// so perfect scaling means Mops/s grows linearly and speedup equals threads.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+#define MAX_THREADS 64
+#define DEFAULT_OPS 200000 // per thread
+#define WINDOW 1024        // live blocks per thread
+#define LARSON_ROUNDS 16   // hand-overs between threads
+#define RING_SIZE 256      // producer/consumer queue depth
+
+typedef struct
+{
+	const char *name;
+	void *(*alloc)(size_t);
+	void (*free)(void *);
+} allocator;
+
+static const allocator allocators[] = {
+    {"custom", _malloc, _free},
+    {"system", malloc, free},
+};
+
+// one single-producer single-consumer queue per thread
+typedef struct
+{
+	void *slots[RING_SIZE];
+	_Alignas(64) size_t head; // next slot to pop, owned by the consumer
+	_Alignas(64) size_t tail; // next slot to push, owned by the producer
+} ring;
+
+typedef struct
+{
+	const allocator *al;
+	int id;
+	int threads;
+	long ops;
+	double start, end; // measured by the thread itself
+} worker;
+
+typedef struct
+{
+	const char *name;
+	void *(*run)(void *);
+} workload;
+
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t round_barrier;
+
+static double nowSeconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// threads start together and time themselves, the main thread may not even
+// be running when they do
+static void startClock(worker *w)
+{
+	pthread_barrier_wait(&start_barrier);
+	w->start = nowSeconds();
+}
+
+static void *stopClock(worker *w)
+{
+	w->end = nowSeconds();
+	return NULL;
+}
+
+static void **larson_slots; // threads * WINDOW blocks, see larson
+static ring rings[MAX_THREADS];
+
+// xorshift, rand() takes a lock and would serialize the threads
+static inline uint32_t nextRandom(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+// touch the block so the allocation cannot be optimized away
+static inline void *allocTouch(const allocator *al, size_t size)
+{
+	char *p = al->alloc(size);
+	if (!p)
+	{
+		fprintf(stderr, "allocation of %zu bytes failed\n", size);
+		exit(1);
+	}
+	p[0] = (char)size;
+	return p;
+}
+
+// Workload: every thread churns through its own window of 16-512 byte blocks
+static void *churn(void *arg)
+{
+	worker *w = arg;
+	uint32_t seed = 2463534242u + w->id;
+	void *window[WINDOW] = {0};
+
+	startClock(w);
+
+	for (long i = 0; i < w->ops; i++)
+	{
+		int slot = nextRandom(&seed) % WINDOW;
+		if (window[slot])
+			w->al->free(window[slot]);
+		window[slot] = allocTouch(w->al, 16 + nextRandom(&seed) % 497);
+	}
+
+	for (int i = 0; i < WINDOW; i++)
+		w->al->free(window[i]);
+	return stopClock(w);
+}
+
+// Workload: like Larson, threads replace random blocks in a window, and every
+// round each window moves on to the next thread, which then frees blocks
+// another thread allocated
+static void *larson(void *arg)
+{
+	worker *w = arg;
+	uint32_t seed = 88675123u + w->id;
+	long per_round = w->ops / LARSON_ROUNDS;
+
+	startClock(w);
+
+	for (int round = 0; round < LARSON_ROUNDS; round++)
+	{
+		void **window =
+		    larson_slots + (size_t)((w->id + round) % w->threads) * WINDOW;
+
+		for (long i = 0; i < per_round; i++)
+		{
+			int slot = nextRandom(&seed) % WINDOW;
+			if (window[slot])
+				w->al->free(window[slot]);
+			window[slot] = allocTouch(w->al, 16 + nextRandom(&seed) % 497);
+		}
+
+		pthread_barrier_wait(&round_barrier);
+	}
+
+	return stopClock(w);
+}
+
+// Workload: every thread allocates into its own queue and frees what the
+// previous thread allocated, so each block is freed by a different thread
+// (by the same one when running alone)
+static void *producerConsumer(void *arg)
+{
+	worker *w = arg;
+	uint32_t seed = 521288629u + w->id;
+	ring *out = &rings[w->id];
+	ring *in = &rings[(w->id + w->threads - 1) % w->threads];
+	long produced = 0, consumed = 0;
+
+	startClock(w);
+
+	while (produced < w->ops || consumed < w->ops)
+	{
+		bool progress = false;
+
+		size_t tail = out->tail;
+		if (produced < w->ops &&
+		    tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < RING_SIZE)
+		{
+			out->slots[tail % RING_SIZE] =
+			    allocTouch(w->al, 16 + nextRandom(&seed) % 497);
+			__atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+			produced++;
+			progress = true;
+		}
+
+		size_t head = in->head;
+		if (consumed < w->ops &&
+		    head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE))
+		{
+			w->al->free(in->slots[head % RING_SIZE]);
+			__atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+			consumed++;
+			progress = true;
+		}
+
+		if (!progress)
+			sched_yield();
+	}
+
+	return stopClock(w);
+}
+
+// Helper: mostly small sizes, some medium ones and a few that come close to
+// the mmap threshold
+static size_t mixedSize(uint32_t *seed)
+{
+	uint32_t r = nextRandom(seed) % 100;
+	if (r < 70)
+		return 16 + nextRandom(seed) % 241;
+	if (r < 95)
+		return 256 + nextRandom(seed) % 3841;
+	return 4096 + nextRandom(seed) % 61441;
+}
+
+// Workload: private windows with a size mix, blocks are filled on the way
+static void *mixed(void *arg)
+{
+	worker *w = arg;
+	uint32_t seed = 3141592653u + w->id;
+	void *window[WINDOW] = {0};
+
+	startClock(w);
+
+	for (long i = 0; i < w->ops; i++)
+	{
+		int slot = nextRandom(&seed) % WINDOW;
+		if (window[slot])
+			w->al->free(window[slot]);
+
+		size_t size = mixedSize(&seed);
+		window[slot] = allocTouch(w->al, size);
+		memset(window[slot], 0, size < 256 ? size : 256);
+	}
+
+	for (int i = 0; i < WINDOW; i++)
+		w->al->free(window[i]);
+	return stopClock(w);
+}
+
+// Run one workload with threads threads, returns million operations per second
+// (a malloc and its free count as one operation)
+static double runWorkload(const workload *wl, const allocator *al, int threads,
+                          long ops)
+{
+	pthread_t tids[MAX_THREADS];
+	worker workers[MAX_THREADS];
+
+	larson_slots = calloc((size_t)threads * WINDOW, sizeof(void *));
+	memset(rings, 0, sizeof(rings));
+	pthread_barrier_init(&start_barrier, NULL, threads);
+	pthread_barrier_init(&round_barrier, NULL, threads);
+
+	for (int i = 0; i < threads; i++)
+	{
+		workers[i] = (worker){al, i, threads, ops, 0, 0};
+		int err = pthread_create(&tids[i], NULL, wl->run, &workers[i]);
+		if (err)
+		{
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+
+	// from the first thread starting to the last one finishing
+	double start = 0, end = 0;
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_join(tids[i], NULL);
+		if (i == 0 || workers[i].start < start)
+			start = workers[i].start;
+		if (workers[i].end > end)
+			end = workers[i].end;
+	}
+	double elapsed = end - start;
+
+	// larson leaves its windows behind for whoever comes last
+	for (size_t i = 0; i < (size_t)threads * WINDOW; i++)
+		if (larson_slots[i])
+			al->free(larson_slots[i]);
+	free(larson_slots);
+
+	pthread_barrier_destroy(&start_barrier);
+	pthread_barrier_destroy(&round_barrier);
+
+	return (double)ops * threads / elapsed / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = argc > 1 ? atoi(argv[1]) : (int)cpus;
+	long ops = argc > 2 ? atol(argv[2]) : DEFAULT_OPS;
+
+	if (max_threads < 1 || max_threads > MAX_THREADS || ops < LARSON_ROUNDS)
+	{
+		fprintf(stderr, "usage: %s [1..%d threads] [ops per thread]\n",
+		        argv[0], MAX_THREADS);
+		return 1;
+	}
+
+	const workload workloads[] = {
+	    {"Thread-private churn", churn},
+	    {"Larson cross-thread free", larson},
+	    {"Producer/consumer", producerConsumer},
+	    {"Mixed sizes", mixed},
+	};
+	int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+
+	printf("\nScalability: %ld ops per thread, up to %d threads (%ld CPUs)\n",
+	       ops, max_threads, cpus);
+
+	for (int i = 0; i < num_workloads; i++)
+	{
+		printf("\n%s\n", workloads[i].name);
+		printf("%8s %14s %9s %14s %9s %8s\n", "Threads", "Custom Mops/s",
+		       "Speedup", "System Mops/s", "Speedup", "Ratio");
+
+		// an untimed run first: heaps, arenas and thread caches get set up
+		// here and not in the 1-thread run every speedup is relative to
+		for (int a = 0; a < 2; a++)
+			runWorkload(&workloads[i], &allocators[a], max_threads, ops);
+
+		double base[2] = {0, 0};
+
+		// 1, 2, 4 ... and max_threads itself
+		for (int threads = 1;;
+		     threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+		{
+			double mops[2];
+			for (int a = 0; a < 2; a++)
+			{
+				mops[a] = runWorkload(&workloads[i], &allocators[a], threads,
+				                      ops);
+				if (threads == 1)
+					base[a] = mops[a];
+			}
+
+			printf("%8d %14.2f %8.2fx %14.2f %8.2fx %7.2fx\n", threads,
+			       mops[0], mops[0] / base[0], mops[1], mops[1] / base[1],
+			       mops[0] / mops[1]);
+
+			if (threads == max_threads)
+				break;
+		}
+	}
+
+	printf("\nSpeedup is relative to one thread of the same allocator, Ratio "
+	       "is custom / system throughput (higher is better).\n\n");
+	return 0;
+}
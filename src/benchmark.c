@@ -1,13 +1,19 @@
 // AI GENERATED
 // ==============================================================================================================================
 
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <malloc.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
 // Include your allocator
 #include "mem.h"
@@ -19,6 +25,11 @@
 #define MEDIUM_SIZE 1024
 #define LARGE_SIZE 8192
 
+// memory pass: a sample every SAMPLE_EVERY allocator calls
+#define SAMPLE_EVERY 32
+#define MAX_SAMPLES 8192
+#define MEMORY_CSV "benchmark_memory.csv"
+
 // Timing utility
 typedef struct
 {
@@ -35,6 +46,93 @@ double timer_end(Timer *t)
 	       (t->end.tv_usec - t->start.tv_usec) / 1000.0;
 }
 
+// Memory sampling
+// Off during the timed runs. The memory pass runs every benchmark once per
+// allocator in a fresh child process and samples RSS, bytes mapped and live
+// bytes as it goes.
+typedef struct
+{
+	double time_ms;
+	size_t rss;    // resident bytes of the process
+	size_t mapped; // bytes the allocator got from the OS
+	size_t live;   // bytes the allocator has handed out
+} MemSample;
+
+static bool sampling = false;
+static bool sampling_custom;
+static long sample_calls;
+static MemSample samples[MAX_SAMPLES];
+static int num_samples;
+static Timer sample_timer;
+static int statm_fd = -1;
+
+void take_sample(void)
+{
+	if (num_samples == MAX_SAMPLES)
+		return;
+
+	MemSample *m = &samples[num_samples++];
+	m->time_ms = timer_end(&sample_timer);
+
+	// statm: size resident shared ... in pages, read without allocating
+	char buf[128];
+	ssize_t n = pread(statm_fd, buf, sizeof(buf) - 1, 0);
+	unsigned long pages = 0;
+	if (n > 0)
+	{
+		buf[n] = '\0';
+		sscanf(buf, "%*s %lu", &pages);
+	}
+	m->rss = pages * sysconf(_SC_PAGESIZE);
+
+	if (sampling_custom)
+	{
+		mem_stats stats = _mallinfo();
+		m->mapped = stats.mapped;
+		m->live = stats.in_use;
+	}
+	else
+	{
+		struct mallinfo2 info = mallinfo2();
+		m->mapped = info.arena + info.hblkhd;
+		m->live = info.uordblks + info.hblkhd;
+	}
+}
+
+static inline void count_call(void)
+{
+	if (sampling && ++sample_calls % SAMPLE_EVERY == 0)
+		take_sample();
+}
+
+// every benchmark allocates through these
+static inline void *call_malloc(bool use_custom, size_t size)
+{
+	void *p = use_custom ? _malloc(size) : malloc(size);
+	count_call();
+	return p;
+}
+
+static inline void call_free(bool use_custom, void *p)
+{
+	use_custom ? _free(p) : free(p);
+	count_call();
+}
+
+static inline void *call_calloc(bool use_custom, size_t num, size_t size)
+{
+	void *p = use_custom ? _calloc(num, size) : calloc(num, size);
+	count_call();
+	return p;
+}
+
+static inline void *call_realloc(bool use_custom, void *p, size_t size)
+{
+	p = use_custom ? _realloc(p, size) : realloc(p, size);
+	count_call();
+	return p;
+}
+
 // Benchmark 1: Sequential small allocations
 double bench_sequential_small(bool use_custom)
 {
@@ -44,11 +142,11 @@ double bench_sequential_small(bool use_custom)
 	timer_start(&t);
 	for (int i = 0; i < 10000; i++)
 	{
-		ptrs[i] = use_custom ? _malloc(SMALL_SIZE) : malloc(SMALL_SIZE);
+		ptrs[i] = call_malloc(use_custom, SMALL_SIZE);
 	}
 	for (int i = 0; i < 10000; i++)
 	{
-		use_custom ? _free(ptrs[i]) : free(ptrs[i]);
+		call_free(use_custom, ptrs[i]);
 	}
 	return timer_end(&t);
 }
@@ -66,13 +164,13 @@ double bench_random_ops(bool use_custom)
 		int idx = rand() % 1000;
 		if (ptrs[idx])
 		{
-			use_custom ? _free(ptrs[idx]) : free(ptrs[idx]);
+			call_free(use_custom, ptrs[idx]);
 			ptrs[idx] = NULL;
 		}
 		else
 		{
 			size_t size = (rand() % 512) + 16;
-			ptrs[idx] = use_custom ? _malloc(size) : malloc(size);
+			ptrs[idx] = call_malloc(use_custom, size);
 		}
 	}
 
@@ -81,7 +179,7 @@ double bench_random_ops(bool use_custom)
 	{
 		if (ptrs[i])
 		{
-			use_custom ? _free(ptrs[i]) : free(ptrs[i]);
+			call_free(use_custom, ptrs[i]);
 		}
 	}
 	return timer_end(&t);
@@ -95,9 +193,24 @@ double bench_alloc_fill_free(bool use_custom)
 	timer_start(&t);
 	for (int i = 0; i < ITERATIONS / 10; i++)
 	{
-		void *p = use_custom ? _malloc(MEDIUM_SIZE) : malloc(MEDIUM_SIZE);
+		void *p = call_malloc(use_custom, MEDIUM_SIZE);
 		memset(p, 'A', MEDIUM_SIZE);
-		use_custom ? _free(p) : free(p);
+		call_free(use_custom, p);
+	}
+	return timer_end(&t);
+}
+
+// Benchmark 3b: Sizes above the thread cache, every call takes the arena lock
+double bench_arena_path(bool use_custom)
+{
+	Timer t;
+	size_t size = 2 * MEDIUM_SIZE;
+
+	timer_start(&t);
+	for (int i = 0; i < ITERATIONS / 10; i++)
+	{
+		void *p = call_malloc(use_custom, size);
+		call_free(use_custom, p);
 	}
 	return timer_end(&t);
 }
@@ -111,12 +224,12 @@ double bench_large_allocs(bool use_custom)
 	timer_start(&t);
 	for (int i = 0; i < 100; i++)
 	{
-		ptrs[i] = use_custom ? _malloc(LARGE_SIZE) : malloc(LARGE_SIZE);
+		ptrs[i] = call_malloc(use_custom, LARGE_SIZE);
 		memset(ptrs[i], 0, LARGE_SIZE);
 	}
 	for (int i = 0; i < 100; i++)
 	{
-		use_custom ? _free(ptrs[i]) : free(ptrs[i]);
+		call_free(use_custom, ptrs[i]);
 	}
 	return timer_end(&t);
 }
@@ -132,25 +245,25 @@ double bench_fragmentation(bool use_custom)
 	// Allocate many blocks
 	for (int i = 0; i < 1000; i++)
 	{
-		ptrs[i] = use_custom ? _malloc(128) : malloc(128);
+		ptrs[i] = call_malloc(use_custom, 128);
 	}
 
 	// Free every other one
 	for (int i = 0; i < 1000; i += 2)
 	{
-		use_custom ? _free(ptrs[i]) : free(ptrs[i]);
+		call_free(use_custom, ptrs[i]);
 	}
 
 	// Allocate in freed spots
 	for (int i = 0; i < 1000; i += 2)
 	{
-		ptrs[i] = use_custom ? _malloc(64) : malloc(64);
+		ptrs[i] = call_malloc(use_custom, 64);
 	}
 
 	// Cleanup
 	for (int i = 0; i < 1000; i++)
 	{
-		use_custom ? _free(ptrs[i]) : free(ptrs[i]);
+		call_free(use_custom, ptrs[i]);
 	}
 
 	return timer_end(&t);
@@ -164,11 +277,11 @@ double bench_realloc_ops(bool use_custom)
 	timer_start(&t);
 	for (int i = 0; i < ITERATIONS / 100; i++)
 	{
-		void *p = use_custom ? _malloc(64) : malloc(64);
-		p = use_custom ? _realloc(p, 256) : realloc(p, 256);
-		p = use_custom ? _realloc(p, 1024) : realloc(p, 1024);
-		p = use_custom ? _realloc(p, 128) : realloc(p, 128);
-		use_custom ? _free(p) : free(p);
+		void *p = call_malloc(use_custom, 64);
+		p = call_realloc(use_custom, p, 256);
+		p = call_realloc(use_custom, p, 1024);
+		p = call_realloc(use_custom, p, 128);
+		call_free(use_custom, p);
 	}
 	return timer_end(&t);
 }
@@ -192,13 +305,13 @@ double bench_mixed_workload(bool use_custom)
 			if (!ptrs[idx])
 			{
 				size_t size = 16 << (rand() % 8); // 16 to 2048
-				ptrs[idx] = use_custom ? _malloc(size) : malloc(size);
+				ptrs[idx] = call_malloc(use_custom, size);
 			}
 			break;
 		case 1: // free
 			if (ptrs[idx])
 			{
-				use_custom ? _free(ptrs[idx]) : free(ptrs[idx]);
+				call_free(use_custom, ptrs[idx]);
 				ptrs[idx] = NULL;
 			}
 			break;
@@ -206,15 +319,14 @@ double bench_mixed_workload(bool use_custom)
 			if (ptrs[idx])
 			{
 				size_t size = 16 << (rand() % 8);
-				ptrs[idx] = use_custom ? _realloc(ptrs[idx], size)
-				                       : realloc(ptrs[idx], size);
+				ptrs[idx] = call_realloc(use_custom, ptrs[idx], size);
 			}
 			break;
 		case 3: // calloc
 			if (!ptrs[idx])
 			{
 				size_t size = (rand() % 256) + 1;
-				ptrs[idx] = use_custom ? _calloc(size, 4) : calloc(size, 4);
+				ptrs[idx] = call_calloc(use_custom, size, 4);
 			}
 			break;
 		}
@@ -225,7 +337,7 @@ double bench_mixed_workload(bool use_custom)
 	{
 		if (ptrs[i])
 		{
-			use_custom ? _free(ptrs[i]) : free(ptrs[i]);
+			call_free(use_custom, ptrs[i]);
 		}
 	}
 	return timer_end(&t);
@@ -301,6 +413,88 @@ Stats calculate_stats(double *values, int n)
 	return s;
 }
 
+typedef struct
+{
+	size_t peak_rss;   // above the RSS the run started with
+	size_t peak_live;  // most bytes live at one sample
+	size_t peak_mapped;
+	double live_ratio; // live / mapped at the sample with the most live
+	size_t end_mapped; // still mapped after the benchmark freed everything
+} MemResult;
+
+// Run one benchmark in a child process with sampling on, append its series
+// to MEMORY_CSV and return the summary through a pipe
+MemResult measure_memory(const Benchmark *b, bool use_custom)
+{
+	MemResult r = {0};
+	int fds[2];
+
+	fflush(stdout);
+	if (pipe(fds) < 0)
+	{
+		perror("pipe");
+		return r;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		return r;
+	}
+
+	if (pid == 0)
+	{
+		close(fds[0]);
+		statm_fd = open("/proc/self/statm", O_RDONLY);
+		sampling = true;
+		sampling_custom = use_custom;
+
+		timer_start(&sample_timer);
+		take_sample();
+		b->benchmark(use_custom);
+		take_sample();
+
+		size_t base_rss = samples[0].rss;
+		for (int i = 0; i < num_samples; i++)
+		{
+			MemSample *m = &samples[i];
+			if (m->rss > base_rss && m->rss - base_rss > r.peak_rss)
+				r.peak_rss = m->rss - base_rss;
+			if (m->mapped > r.peak_mapped)
+				r.peak_mapped = m->mapped;
+			if (m->live > r.peak_live)
+			{
+				r.peak_live = m->live;
+				r.live_ratio = m->mapped ? (double)m->live / m->mapped : 0;
+			}
+		}
+		r.end_mapped = samples[num_samples - 1].mapped;
+
+		FILE *csv = fopen(MEMORY_CSV, "a");
+		if (csv)
+		{
+			for (int i = 0; i < num_samples; i++)
+				fprintf(csv, "\"%s\",%s,%d,%.3f,%zu,%zu,%zu\n", b->name,
+				        use_custom ? "custom" : "system", i, samples[i].time_ms,
+				        samples[i].rss, samples[i].mapped, samples[i].live);
+			fclose(csv);
+		}
+
+		if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if (read(fds[0], &r, sizeof(r)) != sizeof(r))
+		fprintf(stderr, "memory pass of %s failed\n", b->name);
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+
+	return r;
+}
+
 void print_header(void)
 {
 	printf("\n");
@@ -325,6 +519,7 @@ void run_benchmarks(void)
 	    {"Sequential Small Allocs (10k × 64B)", bench_sequential_small},
 	    {"Random Ops (100k ops)", bench_random_ops},
 	    {"Alloc-Fill-Free (10k × 1KB)", bench_alloc_fill_free},
+	    {"Arena Path (10k × 2KB)", bench_arena_path},
 	    {"Large Allocations (100 × 8KB)", bench_large_allocs},
 	    {"Fragmentation Test", bench_fragmentation},
 	    {"Realloc Operations (1k ops)", bench_realloc_ops},
@@ -334,6 +529,23 @@ void run_benchmarks(void)
 	int num_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
 
 	print_header();
+
+	// before any timed run, so the children start from untouched heaps
+	MemResult custom_memory[num_benchmarks];
+	MemResult system_memory[num_benchmarks];
+	FILE *csv = fopen(MEMORY_CSV, "w");
+	if (csv)
+	{
+		fprintf(csv, "benchmark,allocator,sample,time_ms,rss,mapped,live\n");
+		fclose(csv);
+	}
+	printf("Memory pass: one sampled run per benchmark in a fresh process\n");
+	for (int i = 0; i < num_benchmarks; i++)
+	{
+		custom_memory[i] = measure_memory(&benchmarks[i], true);
+		system_memory[i] = measure_memory(&benchmarks[i], false);
+	}
+
 	printf("Running each benchmark %d times and reporting median ± stddev\n\n",
 	       NUM_RUNS);
 	printf("%-40s %15s %15s %10s\n", "Benchmark", "Custom (ms)", "System (ms)",
@@ -417,10 +629,41 @@ void run_benchmarks(void)
 
 	printf("Legend: ✓ = Good (<1.5x)  ~ = Fair (<3x)  ✗ = Slow (>3x)\n");
 	printf("\n");
+
+	printf("%-40s %19s %19s %19s %15s\n", "Memory (KB)", "Peak RSS",
+	       "Peak mapped", "End mapped", "Live / mapped");
+	printf("%-40s %9s %9s %9s %9s %9s %9s %7s %7s\n", "", "Custom", "System",
+	       "Custom", "System", "Custom", "System", "Custom", "System");
+	print_separator();
+	for (int i = 0; i < num_benchmarks; i++)
+	{
+		printf("%-40s %9zu %9zu %9zu %9zu %9zu %9zu %6.0f%% %6.0f%%\n",
+		       benchmarks[i].name, custom_memory[i].peak_rss / 1024,
+		       system_memory[i].peak_rss / 1024,
+		       custom_memory[i].peak_mapped / 1024,
+		       system_memory[i].peak_mapped / 1024,
+		       custom_memory[i].end_mapped / 1024,
+		       system_memory[i].end_mapped / 1024,
+		       custom_memory[i].live_ratio * 100,
+		       system_memory[i].live_ratio * 100);
+	}
+	print_separator();
+	printf("Peak RSS is the growth over the run, end mapped is what stays "
+	       "mapped once the\nbenchmark freed everything, live / mapped is "
+	       "taken when the most bytes were\nlive. Samples every %d calls are "
+	       "in %s.\n\n",
+	       SAMPLE_EVERY, MEMORY_CSV);
 }
 
 int main(void)
 {
 	run_benchmarks();
+
+#ifdef MEM_LATENCY
+	// every custom call of every run above
+	printf("Per-call latency of the custom allocator:\n");
+	_latency_print(stdout);
+	printf("\n");
+#endif
 	return 0;
 }
@@ -1,301 +1,2624 @@
-// needed because apparantly PTHREAD_MUTEX_RECURSIVE is a specific extension
-// (not standard C99)
+// needed for MAP_NORESERVE, MADV_* and syscall()
 #define _GNU_SOURCE
 
 #include "mem.h"
 #include <stddef.h>
 #include <unistd.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#define ALIGNMENT 8
-#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
+// ARENAS
+// Every arena is an independent heap with its own lock. Threads are attached
+// to the least loaded arena the first time they allocate.
+arena arenas[MAX_ARENAS];
+int num_arenas = 0;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
 
-struct block_header *block_list = NULL; // Main list order by address
-struct block_header *free_list = NULL;  // Explicit list of free blocks (LIFO)
+// requests this big bypass the arenas, see mmapMalloc
+size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
 
-// GLOBAL LOCK
-pthread_mutex_t global_malloc_lock = PTHREAD_MUTEX_INITIALIZER;
-bool lock_initialized = false;
+// free pages idle for this long are handed back to the OS, -1 = never
+long purge_decay_ms = DEFAULT_PURGE_DECAY_MS;
 
-const int MIN_HEADER_SIZE = 8;
+// park freed blocks in the arena quick lists instead of coalescing at once
+int defer_coalesce = DEFAULT_DEFER_COALESCE;
+
+// MEM_FIT_* index of the free lists, fixed once an arena holds blocks
+int fit_strategy = DEFAULT_FIT_STRATEGY;
+
+// MEM_HUGE_* backing of new heap regions, fixed once an arena holds blocks
+int huge_pages = DEFAULT_HUGE_PAGES;
+
+// STATISTICS
+// Arena counters are plain fields updated under the arena lock. Memory
+// that belongs to no arena (mappings, large blocks) is counted with relaxed
+// atomics. _mallinfo adds everything up when asked.
+static size_t stat_mapped = 0;     // bytes committed from the OS
+static size_t stat_large = 0;      // payload of large blocks in use
+static size_t stat_large_peak = 0; // high-water mark of stat_large
+
+static inline void countMapped(size_t bytes)
+{
+	__atomic_fetch_add(&stat_mapped, bytes, __ATOMIC_RELAXED);
+}
+
+static inline void countUnmapped(size_t bytes)
+{
+	__atomic_fetch_sub(&stat_mapped, bytes, __ATOMIC_RELAXED);
+}
+
+static void countLarge(size_t bytes)
+{
+	size_t now = __atomic_add_fetch(&stat_large, bytes, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&stat_large_peak, __ATOMIC_RELAXED);
+
+	while (now > peak &&
+	       !__atomic_compare_exchange_n(&stat_large_peak, &peak, now, true,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline void countAlloc(arena *ar, size_t bytes)
+{
+	ar->in_use += bytes;
+	if (ar->in_use > ar->peak_in_use)
+		ar->peak_in_use = ar->in_use;
+}
+
+static inline void countFree(arena *ar, size_t bytes) { ar->in_use -= bytes; }
+
+// smallest payload a block can have: it must hold the free links + footer
+const int MIN_HEADER_SIZE = ALIGN(2 * sizeof(void *) + sizeof(size_t));
 const size_t BLOCK_MAGIC = 0xDEADBEEF;
 const size_t ALIGNED_BLOCK_SIZE = ALIGN(sizeof(struct block_header));
 
-// Helper: Insert block at the head of the free list
-void addToFreeList(struct block_header *block)
+#define LINKS(block) ((free_links *)((block) + 1))
+
+// Helper: payload size without the flag bits
+static inline size_t blockSize(struct block_header *block)
+{
+	return block->size & ~(size_t)BLOCK_FLAGS;
+}
+
+// Helper: physically next block (the epilogue for the last one)
+static inline struct block_header *nextBlock(struct block_header *block)
+{
+	return (struct block_header *)((char *)(block + 1) + blockSize(block));
+}
+
+// Helper: physically previous block, only valid when BLOCK_PREV_FREE is set
+static inline struct block_header *prevBlock(struct block_header *block)
+{
+	size_t prev_size = ((size_t *)block)[-1];
+	return (struct block_header *)((char *)block - prev_size -
+	                               ALIGNED_BLOCK_SIZE);
+}
+
+// Helper: copy the size of a free block into its last payload word
+static inline void setFooter(struct block_header *block)
+{
+	((size_t *)nextBlock(block))[-1] = blockSize(block);
+}
+
+static inline void initHeader(struct block_header *block, size_t size,
+                              uint32_t arena_id)
+{
+	block->size = size;
+	block->magic = (uint32_t)BLOCK_MAGIC;
+	block->arena_id = arena_id;
+}
+
+// Helper: flag a block free and let its right neighbour know
+// The neighbour may be allocated and have BLOCK_CACHED flipped by a thread
+// that does not hold the arena lock, so its flags are updated atomically.
+static void markFree(struct block_header *block)
+{
+	block->size |= BLOCK_FREE;
+	setFooter(block);
+	__atomic_fetch_or(&nextBlock(block)->size, BLOCK_PREV_FREE,
+	                  __ATOMIC_RELAXED);
+}
+
+static void markAllocated(struct block_header *block)
+{
+	block->size &= ~(size_t)BLOCK_FREE;
+	__atomic_fetch_and(&nextBlock(block)->size, ~(size_t)BLOCK_PREV_FREE,
+	                   __ATOMIC_RELAXED);
+}
+
+static inline void setCached(struct block_header *block)
+{
+	__atomic_fetch_or(&block->size, BLOCK_CACHED, __ATOMIC_RELAXED);
+}
+
+static inline void clearCached(struct block_header *block)
+{
+	__atomic_fetch_and(&block->size, ~(size_t)BLOCK_CACHED, __ATOMIC_RELAXED);
+}
+
+// Helper: Map a block size to its size-class bin
+int getBinIndex(size_t size)
+{
+	if (size < 2 * MIN_BIN_SIZE)
+		return 0;
+
+	// floor(log2(size)) - log2(MIN_BIN_SIZE)
+	int bin = (int)(sizeof(size_t) * 8 - 1) - __builtin_clzl(size) - 4;
+	return bin < NUM_BINS - 1 ? bin : NUM_BINS - 1;
+}
+
+// TLSF
+// The first level is the power of two below the size, the second level
+// splits it into TLSF_SL equal classes. A bitmap per level records the
+// non-empty lists, so finding a fitting class takes two find-first-set.
+
+// Helper: Map a block size to its TLSF list
+static void tlsfMapping(size_t size, int *fl, int *sl)
+{
+	if (size < TLSF_LINEAR)
+	{
+		*fl = 0;
+		*sl = (int)(size / ALIGNMENT);
+		return;
+	}
+
+	int log2 = 63 - __builtin_clzl(size);
+	*fl = log2 - 7;
+	*sl = (int)(size >> (log2 - TLSF_SL_LOG)) ^ TLSF_SL;
+}
+
+// Helper: Map a request to the first TLSF list whose blocks all fit it, by
+// rounding it up to the next class boundary first
+static void tlsfSearchMapping(size_t size, int *fl, int *sl)
+{
+	if (size < TLSF_LINEAR)
+		size = ALIGN(size);
+	else
+		size += ((size_t)1 << (63 - __builtin_clzl(size) - TLSF_SL_LOG)) - 1;
+
+	tlsfMapping(size, fl, sl);
+}
+
+// Helper: The list a free block of this size belongs to
+static struct block_header **freeListOf(arena *ar, size_t size)
+{
+	if (fit_strategy == MEM_FIT_TLSF)
+	{
+		int fl, sl;
+		tlsfMapping(size, &fl, &sl);
+		return &ar->tlsf_lists[fl][sl];
+	}
+
+	return &ar->free_lists[getBinIndex(size)];
+}
+
+// Helper: Update the bitmaps after the list of size became (non-)empty
+static void setListBit(arena *ar, size_t size, bool non_empty)
+{
+	if (fit_strategy == MEM_FIT_TLSF)
+	{
+		int fl, sl;
+		tlsfMapping(size, &fl, &sl);
+
+		if (non_empty)
+		{
+			ar->tlsf_sl_map[fl] |= 1u << sl;
+			ar->tlsf_fl_map |= 1ull << fl;
+		}
+		else
+		{
+			ar->tlsf_sl_map[fl] &= ~(1u << sl);
+			if (!ar->tlsf_sl_map[fl])
+				ar->tlsf_fl_map &= ~(1ull << fl);
+		}
+		return;
+	}
+
+	int bin = getBinIndex(size);
+	if (non_empty)
+		ar->bin_map |= 1u << bin;
+	else
+		ar->bin_map &= ~(1u << bin);
+}
+
+// Helper: All list heads of the arena in ascending size order, *count of
+// them. TLSF lists are walked as one flat array.
+static struct block_header **freeLists(arena *ar, int *count)
+{
+	if (fit_strategy == MEM_FIT_TLSF)
+	{
+		*count = TLSF_FL * TLSF_SL;
+		return &ar->tlsf_lists[0][0];
+	}
+
+	*count = NUM_BINS;
+	return ar->free_lists;
+}
+
+// Helper: Position of the list of size in freeLists()
+static int freeListIndex(size_t size)
+{
+	if (fit_strategy == MEM_FIT_TLSF)
+	{
+		int fl, sl;
+		tlsfMapping(size, &fl, &sl);
+		return fl * TLSF_SL + sl;
+	}
+
+	return getBinIndex(size);
+}
+
+// Helper: Position of the non-empty list with the largest blocks in
+// freeLists(), -1 if all are empty
+static int lastFreeList(arena *ar)
+{
+	if (fit_strategy == MEM_FIT_TLSF)
+	{
+		if (!ar->tlsf_fl_map)
+			return -1;
+		int fl = 63 - __builtin_clzll(ar->tlsf_fl_map);
+		return fl * TLSF_SL + 31 - __builtin_clz(ar->tlsf_sl_map[fl]);
+	}
+
+	return ar->bin_map ? 31 - __builtin_clz(ar->bin_map) : -1;
+}
+
+// Helper: Insert block at the head of its size-class free list
+void addToFreeList(arena *ar, struct block_header *block)
 {
-	if (!block->is_free)
+	if (!(block->size & BLOCK_FREE))
 	{
 		fprintf(stderr, "[ERROR] addToFreeList called on allocated block\n");
 		return;
 	}
 
-	block->next_free = free_list;
-	block->prev_free = NULL;
+	struct block_header **head = freeListOf(ar, blockSize(block));
+
+	LINKS(block)->next_free = *head;
+	LINKS(block)->prev_free = NULL;
+
+	if (*head)
+	{
+		LINKS(*head)->prev_free = block;
+	}
+	else
+	{
+		setListBit(ar, blockSize(block), true);
+	}
+
+	*head = block;
+
+	ar->free_blocks[getBinIndex(blockSize(block))]++;
+	ar->free_bytes += blockSize(block);
+}
+
+// Helper: Remove block from its free list
+// NOTE: must be called before the block's size changes, the list is derived
+// from it
+void removeFromFreeList(arena *ar, struct block_header *block)
+{
+	if (!block)
+		return;
+
+	free_links *links = LINKS(block);
+
+	ar->free_blocks[getBinIndex(blockSize(block))]--;
+	ar->free_bytes -= blockSize(block);
+
+	if (links->prev_free)
+	{
+		LINKS(links->prev_free)->next_free = links->next_free;
+	}
+	else
+	{
+		struct block_header **head = freeListOf(ar, blockSize(block));
+		*head = links->next_free;
+		if (!*head)
+			setListBit(ar, blockSize(block), false);
+	}
+
+	if (links->next_free)
+	{
+		LINKS(links->next_free)->prev_free = links->prev_free;
+	}
+
+	links->next_free = NULL;
+	links->prev_free = NULL;
+}
+
+// Helper: mmap whole pages for at least size bytes, NULL with errno set to
+// ENOMEM if the kernel refuses. size must not exceed MAX_REQUEST + a page.
+static void *mapPages(size_t size, size_t *mapped)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t total_size = (size + page_size - 1) & ~(page_size - 1);
+
+	void *start = mmap(NULL, total_size, PROT_WRITE | PROT_READ,
+	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (start == MAP_FAILED)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// the kernel can only back the aligned 2 MB stretches, the rest stays
+	// in small pages
+	if (huge_pages != MEM_HUGE_OFF && total_size >= HUGE_PAGE_SIZE)
+		madvise(start, total_size, MADV_HUGEPAGE);
+
+	countMapped(total_size);
+	*mapped = total_size;
+	return start;
+}
+
+// Helper: Granularity heap regions are committed and purged in
+static size_t commitUnit(void)
+{
+	return huge_pages != MEM_HUGE_OFF ? HUGE_PAGE_SIZE
+	                                  : (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// create a new page and initialize a header and return it
+// The block spans the whole mapping and belongs to no arena. NULL if the
+// mapping failed.
+struct block_header *getHeap(size_t size)
+{
+	size_t total_size;
+	struct block_header *header =
+	    mapPages(size + ALIGNED_BLOCK_SIZE, &total_size);
+	if (!header)
+		return NULL;
+
+	initHeader(header, total_size - ALIGNED_BLOCK_SIZE, NO_ARENA);
+
+	return header;
+}
+
+static void forkPrepare(void);
+static void forkParent(void);
+static void forkChild(void);
+
+// NUMA
+// With more than one memory node the arenas are dealt out to the nodes in
+// turn. Their regions and slab chunks prefer that node (MPOL_PREFERRED, so a
+// full node still falls back to the others) and a thread attaches to an
+// arena of the node it first allocates on. With a single node none of this
+// happens and every arena serves any thread.
+static uint64_t numa_nodes = 0; // bit n set <=> node n has memory, 0 = off
+
+// Helper: Parse a node list like "0-1,3" from sysfs, 0 if it is missing
+static uint64_t readNodeMask(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	char buf[256];
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+
+	uint64_t mask = 0;
+	for (char *p = buf; *p >= '0' && *p <= '9';)
+	{
+		long first = strtol(p, &p, 10);
+		long last = *p == '-' ? strtol(p + 1, &p, 10) : first;
+		for (long node = first; node <= last && node < 64; node++)
+			mask |= 1ULL << node;
+		if (*p == ',')
+			p++;
+	}
+
+	return mask;
+}
+
+// Helper: The n-th node of a mask
+static int nthNode(uint64_t mask, int n)
+{
+	while (n--)
+		mask &= mask - 1;
+	return __builtin_ctzll(mask);
+}
+
+// Helper: The memory node the calling thread runs on
+static int currentNode(void)
+{
+	unsigned int cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= 64 ||
+	    !(numa_nodes & (1ULL << node)))
+		return nthNode(numa_nodes, 0); // CPU-only node or no getcpu
+
+	return (int)node;
+}
+
+// Helper: Prefer the arena's node for a range, without NUMA (or when the
+// kernel refuses) pages land wherever they are first touched
+static void bindToNode(arena *ar, void *start, size_t length)
+{
+	if (!numa_nodes)
+		return;
+
+	unsigned long mask = 1UL << ar->node;
+	syscall(SYS_mbind, start, length, MPOL_PREFERRED, &mask,
+	        sizeof(mask) * 8 + 1, 0);
+}
+
+static void initArenas(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	num_arenas = cpus < 1 ? 1 : cpus > MAX_ARENAS ? MAX_ARENAS : (int)cpus;
+
+	uint64_t nodes = readNodeMask("/sys/devices/system/node/has_memory");
+	int num_nodes = __builtin_popcountll(nodes);
+	if (num_nodes > 1)
+	{
+		numa_nodes = nodes;
+		if (num_arenas < num_nodes)
+			num_arenas = num_nodes;
+		for (int i = 0; i < num_arenas; i++)
+			arenas[i].node = nthNode(nodes, i % num_nodes);
+	}
+
+	// a child must not inherit an arena locked by a thread that is gone
+	pthread_atfork(forkPrepare, forkParent, forkChild);
+}
+
+static uint32_t arenaId(arena *ar) { return (uint32_t)(ar - arenas); }
+
+// LOCKS
+// Arena locks are taken exactly once per public call, so they need not be
+// recursive. An uncontended lock is a single CAS. A contended one spins for a
+// short while, since critical sections are short, and then sleeps on a futex.
+// state: 0 = unlocked, 1 = locked, 2 = locked and someone may be sleeping.
+#define LOCK_SPINS 100
+
+static inline void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void acquireLock(mem_lock *lock)
+{
+	uint32_t *state = &lock->state;
+	uint32_t expected = 0;
+
+	if (__atomic_compare_exchange_n(state, &expected, 1, false,
+	                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	for (int i = 0; i < LOCK_SPINS; i++)
+	{
+		cpuRelax();
+		expected = 0;
+		if (__atomic_load_n(state, __ATOMIC_RELAXED) == 0 &&
+		    __atomic_compare_exchange_n(state, &expected, 1, false,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+	}
+
+	// announce a sleeper, whoever unlocks next has to wake us
+	while (__atomic_exchange_n(state, 2, __ATOMIC_ACQUIRE) != 0)
+		syscall(SYS_futex, state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+}
+
+static void releaseLock(mem_lock *lock)
+{
+	uint32_t *state = &lock->state;
+
+	if (__atomic_exchange_n(state, 0, __ATOMIC_RELEASE) == 2)
+		syscall(SYS_futex, state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline void lockArena(arena *ar) { acquireLock(&ar->lock); }
+static inline void unlockArena(arena *ar) { releaseLock(&ar->lock); }
+
+static void lockPools(void);
+static void unlockPools(void);
+static void resetPoolLocks(void);
+static mem_lock *purgedPagesLock(void);
+
+// fork(): hold every arena and pool across it so the child sees consistent
+// heaps. Pool locks never wait for an arena lock, so they go first, the
+// purged slab pages are taken under an arena lock, so they go last.
+static void forkPrepare(void)
+{
+	lockPools();
+	for (int i = 0; i < num_arenas; i++)
+		lockArena(&arenas[i]);
+	acquireLock(purgedPagesLock());
+}
+
+static void forkParent(void)
+{
+	releaseLock(purgedPagesLock());
+	for (int i = num_arenas - 1; i >= 0; i--)
+		unlockArena(&arenas[i]);
+	unlockPools();
+}
+
+static void forkChild(void)
+{
+	// only the forking thread survives, nobody can be waiting
+	purgedPagesLock()->state = 0;
+	for (int i = 0; i < num_arenas; i++)
+		arenas[i].lock.state = 0;
+	resetPoolLocks();
+}
+
+// PAGE PURGING
+// Free blocks that span whole pages remember when they were freed (in
+// free_links.freed_at, 0 = already purged). Once they stayed free for
+// purge_decay_ms their inner pages are released with MADV_DONTNEED. The
+// header, the links and the footer are never touched, so the block lists
+// stay valid and the pages simply fault back in as zeroes when reused.
+static uint64_t nowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Helper: when a free neighbour's pages got dirty, UINT64_MAX if unknown
+static uint64_t dirtySince(struct block_header *block)
+{
+	if (blockSize(block) < (size_t)sysconf(_SC_PAGESIZE) ||
+	    !LINKS(block)->freed_at)
+		return UINT64_MAX;
+
+	return LINKS(block)->freed_at;
+}
+
+void purgeBlock(struct block_header *block)
+{
+	uintptr_t page_size = commitUnit();
+
+	uintptr_t start = (uintptr_t)(LINKS(block) + 1);
+	start = (start + page_size - 1) & ~(page_size - 1);
+	uintptr_t end = ((uintptr_t)nextBlock(block) - sizeof(size_t)) &
+	                ~(page_size - 1);
+
+	// heapCalloc relies on purged pages being zero, so a failure (older
+	// kernels refuse it on hugetlb pages) leaves the block dirty
+	if (end > start && madvise((void *)start, end - start, MADV_DONTNEED))
+		return;
+
+	LINKS(block)->freed_at = 0;
+}
+
+static void purgeSlabPages(arena *ar, uint64_t now, uint64_t decay);
+
+// Purge every free block whose decay expired, and the empty slab pages. Only
+// bins that can hold a whole page are walked, and at most one pass runs per
+// half decay period so a burst of frees does not turn into a burst of
+// madvise calls.
+void purgeArena(arena *ar, uint64_t now)
+{
+	uint64_t decay = __atomic_load_n(&purge_decay_ms, __ATOMIC_RELAXED);
+
+	// read without the lock by purgeTick
+	__atomic_store_n(&ar->last_purge, now, __ATOMIC_RELAXED);
+
+	// parked blocks can only be purged once they are merged
+	flushQuick(ar);
+
+	int count;
+	struct block_header **lists = freeLists(ar, &count);
+
+	for (int i = freeListIndex(sysconf(_SC_PAGESIZE)); i < count; i++)
+	{
+		for (struct block_header *block = lists[i]; block;
+		     block = LINKS(block)->next_free)
+		{
+			uint64_t freed_at = LINKS(block)->freed_at;
+			if (freed_at && now - freed_at >= decay)
+				purgeBlock(block);
+		}
+	}
+
+	purgeSlabPages(ar, now, decay);
+}
+
+static void maybePurgeArena(arena *ar, uint64_t now)
+{
+	long decay = __atomic_load_n(&purge_decay_ms, __ATOMIC_RELAXED);
+
+	if (decay >= 0 && now - ar->last_purge >= (uint64_t)decay / 2)
+		purgeArena(ar, now);
+}
+
+// Commit grow more bytes at the end of the tail region. The old epilogue
+// becomes the header of the new free space, a new epilogue goes at the end.
+// Returns NULL if the kernel refuses the commit.
+static struct block_header *commitTail(arena *ar, size_t grow)
+{
+	heap_region *tail = ar->regions;
+	char *start = (char *)tail + tail->size;
+
+	if (mprotect(start, grow, PROT_READ | PROT_WRITE) != 0)
+		return NULL;
+	countMapped(grow);
+	tail->size += grow;
+
+	// the old epilogue keeps its BLOCK_PREV_FREE bit
+	struct block_header *block =
+	    (struct block_header *)(start - ALIGNED_BLOCK_SIZE);
+	block->size = (grow - ALIGNED_BLOCK_SIZE) | (block->size & BLOCK_PREV_FREE);
+
+	return block;
+}
+
+// Helper: Reserve address space for a region of at least size bytes, a
+// smaller reservation is tried if the address space is tight. Returns
+// MAP_FAILED if not even size bytes are left.
+static void *reserveRegion(size_t size, size_t *reserve, int flags)
+{
+	void *start;
+	while ((start = mmap(NULL, *reserve, PROT_NONE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0)) ==
+	           MAP_FAILED &&
+	       *reserve > size)
+		*reserve = *reserve / 2 > size ? *reserve / 2 : size;
+
+	return start;
+}
+
+// Helper: Reserve a region with transparent huge pages. The reservation is
+// over-sized by one huge page and trimmed so the region starts 2 MB aligned,
+// every committed 2 MB stretch can then be backed by a single huge page.
+static void *reserveHugeRegion(size_t size, size_t *reserve)
+{
+	*reserve += HUGE_PAGE_SIZE;
+	char *start = reserveRegion(size + HUGE_PAGE_SIZE, reserve, MAP_NORESERVE);
+	if (start == MAP_FAILED)
+		return start;
+
+	char *end = start + *reserve;
+	char *aligned = (char *)(((uintptr_t)start + HUGE_PAGE_SIZE - 1) &
+	                         ~(HUGE_PAGE_SIZE - 1));
+	*reserve = (size_t)(end - aligned) & ~(HUGE_PAGE_SIZE - 1);
+
+	if (aligned > start)
+		munmap(start, aligned - start);
+	if (aligned + *reserve < end)
+		munmap(aligned + *reserve, end - (aligned + *reserve));
+
+	// not all kernels have THP, the region still works without it
+	madvise(aligned, *reserve, MADV_HUGEPAGE);
+	return aligned;
+}
+
+// Reserve address space for a new region and commit its first grow bytes.
+// Returns NULL if either fails.
+static struct block_header *newRegion(arena *ar, size_t grow)
+{
+	size_t reserve = grow > HEAP_RESERVE_SIZE ? grow : HEAP_RESERVE_SIZE;
+	void *start = MAP_FAILED;
+
+	// hugetlb pages are taken from the pool when the mapping is made, so
+	// once that succeeded faults cannot fail. An empty pool falls back.
+	if (huge_pages == MEM_HUGE_HUGETLB)
+	{
+		size_t pool = grow > HUGETLB_RESERVE_SIZE ? grow : HUGETLB_RESERVE_SIZE;
+		start = reserveRegion(grow, &pool, MAP_HUGETLB);
+		if (start != MAP_FAILED)
+			reserve = pool;
+	}
+
+	if (start == MAP_FAILED)
+		start = huge_pages != MEM_HUGE_OFF
+		            ? reserveHugeRegion(grow, &reserve)
+		            : reserveRegion(grow, &reserve, MAP_NORESERVE);
+
+	if (start == MAP_FAILED)
+		return NULL;
+	bindToNode(ar, start, reserve);
+
+	if (mprotect(start, grow, PROT_READ | PROT_WRITE) != 0)
+	{
+		munmap(start, reserve);
+		return NULL;
+	}
+	countMapped(grow);
+
+	heap_region *region = (heap_region *)start;
+	region->size = grow;
+	region->reserved = reserve;
+	region->next = ar->regions;
+	ar->regions = region;
+
+	struct block_header *block = (struct block_header *)(region + 1);
+	initHeader(block, grow - sizeof(heap_region) - 2 * ALIGNED_BLOCK_SIZE,
+	           arenaId(ar));
+
+	return block;
+}
+
+// Helper: close off freshly committed space with a new epilogue and turn
+// the space itself into a free block. Passes a failed growth (NULL) on.
+static struct block_header *sealGrowth(arena *ar, struct block_header *block)
+{
+	if (!block)
+		return NULL;
+
+	// epilogue: allocated, zero-size, ends every physical walk
+	initHeader((struct block_header *)((char *)ar->regions +
+	                                   ar->regions->size - ALIGNED_BLOCK_SIZE),
+	           0, arenaId(ar));
+
+	// fresh pages are not resident, nothing to purge yet
+	markFree(block);
+	LINKS(block)->freed_at = 0;
+	return block;
+}
+
+// Extend the tail region in place so the free space at its end holds at
+// least min_size bytes, only the part a free last block cannot cover gets
+// committed. Returns the new free space (not yet in a free list, it follows
+// the old last block) or NULL if the reservation is used up or the commit
+// failed.
+static struct block_header *growTail(arena *ar, size_t min_size)
+{
+	size_t page_size = commitUnit();
+	heap_region *tail = ar->regions;
+
+	if (!tail)
+		return NULL;
+
+	struct block_header *epilogue =
+	    (struct block_header *)((char *)tail + tail->size - ALIGNED_BLOCK_SIZE);
+
+	// a free last block merges with the new space
+	size_t need = min_size + ALIGNED_BLOCK_SIZE;
+	if (epilogue->size & BLOCK_PREV_FREE)
+	{
+		size_t last_free = ((size_t *)epilogue)[-1];
+		need = min_size > last_free ? min_size - last_free : page_size;
+	}
+
+	size_t grow = (need + page_size - 1) & ~(page_size - 1);
+	grow = grow < HEAP_COMMIT_STEP ? HEAP_COMMIT_STEP : grow;
+
+	size_t room = tail->reserved - tail->size;
+	if (room < need)
+		return NULL;
+
+	return sealGrowth(ar, commitTail(ar, grow < room ? grow : room));
+}
+
+// Make room for a free block of at least min_size bytes at the end of the
+// arena and return the new free space (not yet in a free list). The tail
+// region is extended in place when it can be, a new region is reserved
+// otherwise. Returns NULL if the system is out of memory.
+static struct block_header *growHeap(arena *ar, size_t min_size)
+{
+	struct block_header *block = growTail(ar, min_size);
+	if (block)
+		return block;
+
+	size_t page_size = commitUnit();
+	size_t grow = min_size + sizeof(heap_region) + 2 * ALIGNED_BLOCK_SIZE;
+	grow = (grow + page_size - 1) & ~(page_size - 1);
+	grow = grow < HEAP_COMMIT_STEP ? HEAP_COMMIT_STEP : grow;
+
+	return sealGrowth(ar, newRegion(ar, grow));
+}
+
+bool initHeap(arena *ar)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	struct block_header *header = growHeap(ar, page_size);
+	if (!header)
+		return false;
+
+	// Add initial block to free list
+	addToFreeList(ar, header);
+	return true;
+}
+
+// NOTE: requires the current block to be in the free_list
+// returns the merged block, which may start at the previous block
+struct block_header *coalesce(arena *ar, struct block_header *current)
+{
+	// the block's size (and so its bin) is about to change, take it out and
+	// put the merged result back at the end
+	removeFromFreeList(ar, current);
+
+	// the merged block keeps the oldest decay clock of its parts, so
+	// freeing next to an idle block does not keep postponing its purge
+	uint64_t oldest = UINT64_MAX;
+
+	// MERGE WITH NEXT
+	// The epilogue is never free, so this stops at the end of the region
+	struct block_header *next_block = nextBlock(current);
+	if (next_block->size & BLOCK_FREE)
+	{
+		// IMPORTANT: Remove the absorbed block from the free list first
+		removeFromFreeList(ar, next_block);
+		oldest = dirtySince(next_block);
+
+		current->size += blockSize(next_block) + ALIGNED_BLOCK_SIZE;
+
+		// next_block is now garbage
+	}
+
+	// MERGE WITH PREV
+	// The footer tells us where it starts
+	if (current->size & BLOCK_PREV_FREE)
+	{
+		struct block_header *prev_block = prevBlock(current);
+
+		// IMPORTANT: prev changes size too, so it has to change bins
+		removeFromFreeList(ar, prev_block);
+		uint64_t prev_since = dirtySince(prev_block);
+		oldest = prev_since < oldest ? prev_since : oldest;
+
+		prev_block->size += blockSize(current) + ALIGNED_BLOCK_SIZE;
+
+		// current is now garbage, the merged block lives at prev_block
+		current = prev_block;
+	}
+
+	setFooter(current);
+
+	// big enough to hold whole pages: start its decay clock
+	if (blockSize(current) >= (size_t)sysconf(_SC_PAGESIZE))
+	{
+		uint64_t now = nowMs();
+		LINKS(current)->freed_at = oldest < now ? oldest : now;
+	}
+
+	addToFreeList(ar, current);
+	return current;
+}
+
+void validate_list(void)
+{
+	for (int i = 0; i < num_arenas; i++)
+	{
+		lockArena(&arenas[i]);
+
+		int count = 0;
+		size_t free_bytes = 0;
+		for (heap_region *region = arenas[i].regions; region;
+		     region = region->next)
+		{
+			struct block_header *walk = (struct block_header *)(region + 1);
+			bool prev_free = false;
+
+			while (true)
+			{
+				if (walk->magic != (uint32_t)BLOCK_MAGIC ||
+				    walk->arena_id != (uint32_t)i ||
+				    !!(walk->size & BLOCK_PREV_FREE) != prev_free ||
+				    (prev_free && (walk->size & BLOCK_FREE)))
+				{
+					printf("[ERROR] Corrupted block at %p, size=%zx\n",
+					       (void *)walk, walk->size);
+					abort();
+				}
+
+				// epilogue
+				if (blockSize(walk) == 0)
+					break;
+
+				prev_free = walk->size & BLOCK_FREE;
+				if (prev_free)
+					free_bytes += blockSize(walk);
+				if (prev_free && ((size_t *)nextBlock(walk))[-1] !=
+				                     blockSize(walk))
+				{
+					printf("[ERROR] Bad footer on block %p\n", (void *)walk);
+					abort();
+				}
+
+				walk = nextBlock(walk);
+				count++;
+			}
+		}
+		// printf("List validated: %d blocks\n\n", count);
+
+		if (free_bytes != arenas[i].free_bytes)
+		{
+			printf("[ERROR] Arena %d counts %zu free bytes, heap has %zu\n", i,
+			       arenas[i].free_bytes, free_bytes);
+			abort();
+		}
+
+		unlockArena(&arenas[i]);
+	}
+}
+
+bool expandHeap(arena *ar, size_t min_size)
+{
+	if (!ar->regions)
+		return initHeap(ar);
+
+	struct block_header *new_page_block = growHeap(ar, min_size);
+	if (!new_page_block)
+		return false;
+
+	// fresh pages are zero, only what a free left neighbour brings in may
+	// not be: all of a small block, or the last page of a clean one (purges
+	// leave it alone). Zeroing that keeps the merged block clean for
+	// heapCalloc. A dirty big neighbour makes the whole block dirty.
+	char *scrub_from = NULL;
+	bool clean = true;
+	if (new_page_block->size & BLOCK_PREV_FREE)
+	{
+		struct block_header *prev = prevBlock(new_page_block);
+		uintptr_t unit = commitUnit();
+
+		if (blockSize(prev) < (size_t)sysconf(_SC_PAGESIZE))
+			scrub_from = (char *)(LINKS(prev) + 1);
+		else if (!LINKS(prev)->freed_at)
+			scrub_from = (char *)(((uintptr_t)nextBlock(prev) -
+			                       sizeof(size_t)) & ~(unit - 1));
+		else
+			clean = false;
+	}
+
+	// Add new block to free list
+	addToFreeList(ar, new_page_block);
+
+	// the new pages follow the old last block, if that one was free they
+	// merge into one block big enough for min_size
+	struct block_header *merged = coalesce(ar, new_page_block);
+
+	if (clean && blockSize(merged) >= (size_t)sysconf(_SC_PAGESIZE))
+	{
+		// up to the end of the new space's links, the old epilogue
+		// included; the merged block's own links stay
+		char *scrub_to = (char *)(LINKS(new_page_block) + 1);
+		char *links_end = (char *)(LINKS(merged) + 1);
+		if (scrub_from && scrub_from < links_end)
+			scrub_from = links_end;
+		if (scrub_from && scrub_from < scrub_to)
+			memset(scrub_from, 0, scrub_to - scrub_from);
+
+		LINKS(merged)->freed_at = 0;
+	}
+
+	// validate_list();
+	return true;
+}
+
+// TLSF lookup: the first class past the rounded-up request holds only blocks
+// that fit, so the answer is the head of the first non-empty list from
+// there. Never walks a list.
+static struct block_header *tlsfFindFreeBlock(arena *ar, size_t length)
+{
+	int fl, sl;
+	tlsfSearchMapping(length, &fl, &sl);
+
+	uint32_t sl_map = fl < TLSF_FL ? ar->tlsf_sl_map[fl] & (~0u << sl) : 0;
+	if (!sl_map)
+	{
+		uint64_t fl_map =
+		    fl + 1 < TLSF_FL ? ar->tlsf_fl_map & (~0ull << (fl + 1)) : 0;
+		if (!fl_map)
+		{
+			// the class of length itself may still hold a big enough
+			// block, its head is worth one look before growing the heap
+			tlsfMapping(length, &fl, &sl);
+			struct block_header *head = ar->tlsf_lists[fl][sl];
+			return head && blockSize(head) >= length ? head : NULL;
+		}
+
+		fl = __builtin_ctzll(fl_map);
+		sl_map = ar->tlsf_sl_map[fl];
+	}
+
+	return ar->tlsf_lists[fl][__builtin_ctz(sl_map)];
+}
+
+// Find a free block of at least length bytes. The matching bin is searched
+// first-fit (its blocks may still be too small), after that the head of the
+// next non-empty bin is always big enough.
+struct block_header *findFreeBlock(arena *ar, size_t length)
+{
+	if (fit_strategy == MEM_FIT_TLSF)
+		return tlsfFindFreeBlock(ar, length);
+
+	int bin = getBinIndex(length);
+
+	for (struct block_header *current = ar->free_lists[bin]; current;
+	     current = LINKS(current)->next_free)
+	{
+		if (blockSize(current) >= length)
+			return current;
+	}
+
+	unsigned int larger = ar->bin_map & ~((2u << bin) - 1);
+	if (!larger)
+		return NULL;
+
+	return ar->free_lists[__builtin_ctz(larger)];
+}
+
+// DEFERRED COALESCING
+// With defer_coalesce set, heapFree parks blocks in per-size-class quick
+// lists instead of merging them. A parked block stays allocated as far as
+// its neighbours are concerned (BLOCK_CACHED, like in a thread cache), so a
+// block freed and requested again in a churn loop skips both coalescing and
+// re-splitting. The lists are merged in one batch when an allocation finds
+// nothing else, when they overflow or when the arena is purged.
+static void quickPush(arena *ar, struct block_header *block)
+{
+	int bin = getBinIndex(blockSize(block));
+
+	setCached(block);
+	if (blockSize(block) >= (size_t)sysconf(_SC_PAGESIZE))
+		LINKS(block)->freed_at = nowMs();
+
+	LINKS(block)->next_free = ar->quick[bin];
+	ar->quick[bin] = block;
+	ar->quick_count++;
+}
+
+// Helper: reuse a parked block of at least length bytes, a big remainder is
+// split off and goes to the free lists. Returns NULL on a miss.
+static struct block_header *takeQuick(arena *ar, size_t length)
+{
+	struct block_header **link = &ar->quick[getBinIndex(length)];
+
+	while (*link && blockSize(*link) < length)
+		link = &LINKS(*link)->next_free;
+
+	struct block_header *block = *link;
+	if (!block)
+		return NULL;
+
+	*link = LINKS(block)->next_free;
+	ar->quick_count--;
+	clearCached(block);
+
+	size_t remaining = blockSize(block) - length;
+	if (remaining >= ALIGNED_BLOCK_SIZE + MIN_HEADER_SIZE)
+	{
+		struct block_header *rest =
+		    (struct block_header *)((char *)(block + 1) + length);
+		initHeader(rest, remaining - ALIGNED_BLOCK_SIZE, arenaId(ar));
+		block->size = length | (block->size & BLOCK_FLAGS);
+
+		markFree(rest);
+		addToFreeList(ar, rest);
+		coalesce(ar, rest);
+	}
+
+	countAlloc(ar, blockSize(block));
+	return block;
+}
+
+// Merge every parked block into the free lists. Caller holds the arena lock.
+void flushQuick(arena *ar)
+{
+	for (int bin = 0; bin < NUM_BINS && ar->quick_count; bin++)
+	{
+		while (ar->quick[bin])
+		{
+			struct block_header *block = ar->quick[bin];
+			ar->quick[bin] = LINKS(block)->next_free;
+			ar->quick_count--;
+
+			clearCached(block);
+			markFree(block);
+			addToFreeList(ar, block);
+			coalesce(ar, block);
+		}
+	}
+}
+
+// Helper: find a free block of at least length bytes, growing the heap if
+// there is none, and take it out of its free list. Returns NULL if the heap
+// cannot grow.
+static struct block_header *takeBlock(arena *ar, size_t length)
+{
+	if (__atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED))
+		drainRemoteFrees(ar);
+
+	if (!ar->regions && !initHeap(ar))
+		return NULL;
+
+	// if no space found, merge the parked blocks or expand the heap,
+	// afterwards a block is big enough
+	struct block_header *current;
+	while (!(current = findFreeBlock(ar, length)))
+	{
+		if (ar->quick_count)
+			flushQuick(ar);
+		else if (!expandHeap(ar, length))
+			return NULL;
+	}
+
+	// IMPORTANT: Remove from free list first
+	removeFromFreeList(ar, current);
+	return current;
+}
+
+// Helper: allocate the first length bytes of a block taken from a free
+// list, the rest goes back as a new free block if it is big enough
+static void carveBlock(arena *ar, struct block_header *current, size_t length)
+{
+	// split block logic
+	size_t remaining = blockSize(current) - length;
+	if (remaining >= ALIGNED_BLOCK_SIZE + MIN_HEADER_SIZE)
+	{
+		uint64_t freed_at = LINKS(current)->freed_at;
+
+		// get pointer to data area (right after the header)
+		void *data_start = (void *)(current + 1);
+
+		// create the new header for the split part
+		struct block_header *new_block =
+		    (struct block_header *)((char *)data_start + length);
+
+		// Setup new block, its right neighbour still sees a free block
+		// before it
+		initHeader(new_block, remaining - ALIGNED_BLOCK_SIZE, arenaId(ar));
+		new_block->size |= BLOCK_FREE;
+		setFooter(new_block);
+		current->size = length | (current->size & BLOCK_PREV_FREE);
+
+		// the remainder inherits the decay clock
+		if (blockSize(new_block) >= (size_t)sysconf(_SC_PAGESIZE))
+			LINKS(new_block)->freed_at = freed_at;
+
+		// Add new block to free list
+		addToFreeList(ar, new_block);
+	}
+	else
+	{
+		// allocate memory
+		markAllocated(current);
+	}
+
+	countAlloc(ar, blockSize(current));
+}
+
+// Allocate from an arena, length must already be aligned.
+// Caller holds the arena lock.
+void *heapMalloc(arena *ar, size_t length)
+{
+	struct block_header *current;
+
+	if (ar->quick_count && (current = takeQuick(ar, length)))
+		return (void *)(current + 1);
+
+	current = takeBlock(ar, length);
+	if (!current)
+		return NULL;
+	carveBlock(ar, current, length);
+
+	// return pointer to data section (skip the header)
+	return (void *)(current + 1);
+}
+
+// Allocate length bytes aligned to alignment (a power of two above
+// ALIGNMENT). The slack in front of the aligned address becomes a free block
+// of its own, so it must be either empty or big enough to be one.
+// Caller holds the arena lock.
+void *heapMemalign(arena *ar, size_t alignment, size_t length)
+{
+	size_t min_lead = ALIGNED_BLOCK_SIZE + MIN_HEADER_SIZE;
+	struct block_header *current =
+	    takeBlock(ar, length + alignment + min_lead);
+	if (!current)
+		return NULL;
+	uint64_t freed_at = LINKS(current)->freed_at;
+
+	uintptr_t data = (uintptr_t)(current + 1);
+	uintptr_t aligned = (data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+	if (aligned != data && aligned - data < min_lead)
+		aligned += alignment;
+
+	if (aligned != data)
+	{
+		// the aligned block takes over everything after the slack, the
+		// slack itself goes back as a free block
+		size_t lead = aligned - data;
+		struct block_header *block = (struct block_header *)aligned - 1;
+		initHeader(block, blockSize(current) - lead, arenaId(ar));
+		block->size |= BLOCK_FREE | BLOCK_PREV_FREE;
+		LINKS(block)->freed_at = freed_at;
+
+		// free blocks never have a free left neighbour, so no flags to keep
+		current->size = (lead - ALIGNED_BLOCK_SIZE) | BLOCK_FREE;
+		setFooter(current);
+		if (blockSize(current) >= (size_t)sysconf(_SC_PAGESIZE))
+			LINKS(current)->freed_at = freed_at;
+		addToFreeList(ar, current);
+
+		current = block;
+	}
+
+	carveBlock(ar, current, length);
+	return (void *)(current + 1);
+}
+
+// Like heapMalloc, and also report which part of the payload is known to be
+// zero: bytes [*clean_from, *clean_to). That is the inside of a block that
+// is fresh from the kernel or was purged (freed_at == 0), minus the pages
+// holding its free links and footer. Caller holds the arena lock.
+void *heapCalloc(arena *ar, size_t length, size_t *clean_from,
+                 size_t *clean_to)
+{
+	struct block_header *current;
+
+	// nothing is known about a parked block
+	*clean_from = *clean_to = length;
+	if (ar->quick_count && (current = takeQuick(ar, length)))
+		return (void *)(current + 1);
+
+	current = takeBlock(ar, length);
+	if (!current)
+		return NULL;
+	uintptr_t page_size = commitUnit();
+	uintptr_t data = (uintptr_t)(current + 1);
+
+	if (blockSize(current) >= (size_t)sysconf(_SC_PAGESIZE) &&
+	    !LINKS(current)->freed_at)
+	{
+		// the same page range purgeBlock releases
+		uintptr_t start = (data + sizeof(free_links) + page_size - 1) &
+		                  ~(page_size - 1);
+		uintptr_t end = ((uintptr_t)nextBlock(current) - sizeof(size_t)) &
+		                ~(page_size - 1);
+
+		if (end > start && start - data < length)
+		{
+			*clean_from = start - data;
+			*clean_to = end - data < length ? end - data : length;
+		}
+	}
+
+	carveBlock(ar, current, length);
+	return (void *)data;
+}
+
+// Return an allocated block to the arena that owns it.
+// Caller holds that arena's lock.
+void heapFree(struct block_header *current)
+{
+	arena *ar = &arenas[current->arena_id];
+
+	countFree(ar, blockSize(current));
+
+	if (__atomic_load_n(&defer_coalesce, __ATOMIC_RELAXED))
+	{
+		quickPush(ar, current);
+		if (ar->quick_count <= QUICK_MAX)
+			return;
+
+		flushQuick(ar);
+		maybePurgeArena(ar, nowMs());
+		return;
+	}
+
+	markFree(current);
+
+	// Add to free list (LIFO)
+	addToFreeList(ar, current);
+
+	// Coalesce physically
+	current = coalesce(ar, current);
+
+	if (blockSize(current) >= (size_t)sysconf(_SC_PAGESIZE))
+		maybePurgeArena(ar, nowMs());
+}
+
+// Helper: is block the last one before the epilogue of the tail region
+static bool isTailBlock(arena *ar, struct block_header *block)
+{
+	heap_region *tail = ar->regions;
+	return (char *)nextBlock(block) ==
+	       (char *)tail + tail->size - ALIGNED_BLOCK_SIZE;
+}
+
+// Grow an allocated block to length bytes without moving it, by absorbing
+// a free right neighbour and, for the last block of the heap, committing
+// more of the reservation. Any excess is split off again. Returns false if
+// the block has to move. Caller holds the arena lock.
+bool heapGrow(arena *ar, struct block_header *block, size_t length)
+{
+	struct block_header *next = nextBlock(block);
+	size_t avail = blockSize(block);
+	size_t old_size = avail;
+
+	if (next->size & BLOCK_FREE)
+		avail += ALIGNED_BLOCK_SIZE + blockSize(next);
+
+	if (avail < length)
+	{
+		// only the tail can grow, either right after the block or after its
+		// free neighbour
+		struct block_header *last = (next->size & BLOCK_FREE) ? next : block;
+		if (!isTailBlock(ar, last))
+			return false;
+
+		// growTail wants the size of the whole free space at the end, which
+		// includes a free neighbour
+		size_t min_size = last == block
+		                      ? length - avail
+		                      : length - blockSize(block) - ALIGNED_BLOCK_SIZE;
+		struct block_header *space = growTail(ar, min_size);
+		if (!space)
+			return false;
+
+		addToFreeList(ar, space);
+		coalesce(ar, space);
+		next = nextBlock(block);
+	}
+
+	// absorb the neighbour, it is free now whatever happened above
+	removeFromFreeList(ar, next);
+	uint64_t freed_at = LINKS(next)->freed_at;
+	size_t total = blockSize(block) + ALIGNED_BLOCK_SIZE + blockSize(next);
+	size_t remaining = total - length;
+
+	if (remaining >= ALIGNED_BLOCK_SIZE + MIN_HEADER_SIZE)
+	{
+		// split off the excess, its right neighbour still sees a free block
+		struct block_header *rest =
+		    (struct block_header *)((char *)(block + 1) + length);
+		initHeader(rest, remaining - ALIGNED_BLOCK_SIZE, arenaId(ar));
+		rest->size |= BLOCK_FREE;
+		setFooter(rest);
+		block->size = length | (block->size & BLOCK_FLAGS);
+
+		// the remainder inherits the decay clock
+		if (blockSize(rest) >= (size_t)sysconf(_SC_PAGESIZE))
+			LINKS(rest)->freed_at = freed_at;
+
+		addToFreeList(ar, rest);
+	}
+	else
+	{
+		block->size = total | (block->size & BLOCK_FLAGS);
+		markAllocated(block);
+	}
+
+	countAlloc(ar, blockSize(block) - old_size);
+	return true;
+}
+
+// LARGE BLOCKS
+// Big requests get a dedicated mapping. They never enter a free list or
+// coalesce, and _free hands the pages straight back to the OS.
+void *mmapMalloc(size_t length)
+{
+	struct block_header *block = getHeap(length);
+	if (!block)
+		return NULL;
+	countLarge(blockSize(block));
+
+	return (void *)(block + 1);
+}
+
+// Helper: start of the mapping a large block lives in. That is the block
+// itself unless it was allocated with a big alignment.
+static inline char *mappingStart(struct block_header *block)
+{
+	return (char *)((uintptr_t)block & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1));
+}
+
+void mmapFree(struct block_header *block)
+{
+	char *start = mappingStart(block);
+	size_t total = (char *)nextBlock(block) - start;
+
+	__atomic_fetch_sub(&stat_large, blockSize(block), __ATOMIC_RELAXED);
+	countUnmapped(total);
+	if (munmap(start, total) != 0)
+		perror("Unmap failed");
+}
+
+// Resize a mapped block to hold length bytes, the kernel moves the pages
+// if needed so nothing is copied. Returns the (possibly moved) block or NULL.
+// Like realloc, only ALIGNMENT is guaranteed afterwards: a _memalign block
+// aligned above a page can land on any page boundary.
+struct block_header *mmapRealloc(struct block_header *block, size_t length)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	char *start = mappingStart(block);
+	size_t offset = (char *)block - start;
+	size_t old_total = (char *)nextBlock(block) - start;
+	size_t old_size = blockSize(block);
+	size_t new_total =
+	    (offset + ALIGNED_BLOCK_SIZE + length + page_size - 1) &
+	    ~(page_size - 1);
+
+	// on failure the old mapping stays as it was
+	void *moved = mremap(start, old_total, new_total, MREMAP_MAYMOVE);
+	if (moved == MAP_FAILED)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// the offset within the page stays the same, so does any alignment up
+	// to a page
+	block = (struct block_header *)((char *)moved + offset);
+	block->size = new_total - offset - ALIGNED_BLOCK_SIZE;
+
+	// sizes only ever grow here, unsigned wrap-around covers the rest
+	countMapped(new_total - old_total);
+	countLarge(blockSize(block) - old_size);
+	return block;
+}
+
+// A mapping whose data is aligned to alignment: map enough to find such an
+// address, then unmap the whole pages before the header and after the data
+void *mmapMemalign(size_t alignment, size_t length)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t mapped;
+	char *start = mapPages(length + alignment + ALIGNED_BLOCK_SIZE, &mapped);
+	if (!start)
+		return NULL;
+	char *end = start + mapped;
+
+	uintptr_t data = (uintptr_t)start + ALIGNED_BLOCK_SIZE;
+	data = (data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+	struct block_header *block = (struct block_header *)data - 1;
+	char *first = mappingStart(block);
+	char *last = (char *)((data + length + page_size - 1) & ~(page_size - 1));
+
+	if (first > start)
+		munmap(start, first - start);
+	if (end > last)
+		munmap(last, end - last);
+	countUnmapped((first - start) + (end - last));
+
+	initHeader(block, last - (char *)data, NO_ARENA);
+	countLarge(blockSize(block));
+	return (void *)data;
+}
+
+// REGIONS
+// A region hands out memory by bumping a pointer through its head chunk.
+// Chunks are large blocks (see mmapMalloc) starting with a region_chunk
+// header, so they count as in use and never touch an arena or its lock.
+typedef struct region_chunk
+{
+	_Alignas(ALIGNMENT) struct region_chunk *next;
+	char *end; // end of the usable space
+} region_chunk;
+
+// Helper: Map a chunk with room for at least size bytes after its header,
+// NULL if that failed
+static region_chunk *newChunk(size_t size)
+{
+	region_chunk *chunk = mmapMalloc(sizeof(region_chunk) + size);
+	if (!chunk)
+		return NULL;
+	chunk->end = (char *)chunk + blockSize((struct block_header *)chunk - 1);
+	return chunk;
+}
+
+static inline void freeChunk(region_chunk *chunk)
+{
+	mmapFree((struct block_header *)chunk - 1);
+}
+
+mem_region *_region_create(void)
+{
+	mem_region *region = _malloc(sizeof(mem_region));
+	if (!region)
+		return NULL;
+
+	*region = (mem_region){NULL, NULL, NULL, REGION_MIN_CHUNK / 2};
+	return region;
+}
+
+// Helper: Find room for size bytes once the head chunk is full
+static void *regionAllocSlow(mem_region *region, size_t size)
+{
+	// a big request gets its own chunk behind the head, whose free space
+	// stays in use
+	if (size > REGION_MAX_CHUNK / 4 && region->chunks)
+	{
+		region_chunk *chunk = newChunk(size);
+		if (!chunk)
+			return NULL;
+		chunk->next = region->chunks->next;
+		region->chunks->next = chunk;
+		return chunk + 1;
+	}
+
+	size_t chunk_size = region->chunk_size < REGION_MAX_CHUNK
+	                        ? region->chunk_size * 2
+	                        : REGION_MAX_CHUNK;
+	if (chunk_size < size)
+		chunk_size = size;
+
+	region_chunk *chunk = newChunk(chunk_size);
+	if (!chunk)
+		return NULL;
+	chunk->next = region->chunks;
+	region->chunks = chunk;
+	region->chunk_size = chunk_size;
+
+	region->top = (char *)(chunk + 1) + size;
+	region->end = chunk->end;
+	return chunk + 1;
+}
+
+// ALIGNMENT aligned and uninitialized, NULL if no memory is left
+void *_region_alloc(mem_region *region, size_t size)
+{
+	if (size > MAX_REQUEST)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size = size ? ALIGN(size) : ALIGNMENT;
+	if ((size_t)(region->end - region->top) < size)
+		return regionAllocSlow(region, size);
+
+	void *ptr = region->top;
+	region->top += size;
+	return ptr;
+}
+
+// Release every object at once. The head chunk is the largest regular one
+// and is kept, so a region reset once per request stops mapping memory after
+// the first few requests.
+void _region_reset(mem_region *region)
+{
+	region_chunk *head = region->chunks;
+	if (!head)
+		return;
+
+	for (region_chunk *chunk = head->next, *next; chunk; chunk = next)
+	{
+		next = chunk->next;
+		freeChunk(chunk);
+	}
+
+	head->next = NULL;
+	region->top = (char *)(head + 1);
+}
+
+void _region_destroy(mem_region *region)
+{
+	if (!region)
+		return;
+
+	for (region_chunk *chunk = region->chunks, *next; chunk; chunk = next)
+	{
+		next = chunk->next;
+		freeChunk(chunk);
+	}
+
+	_free(region);
+}
+
+// SLABS
+// Objects up to SLAB_MAX_SIZE bytes live in slabs: one page holding a small
+// header and same-sized slots, with a bitmap of free slots instead of
+// per-object headers. All slab pages come from one reservation, so _free
+// recognises a slab pointer by its address and finds the slab header at the
+// start of its page. Slabs belong to an arena and are guarded by its lock.
+//
+// Empty pages wait on their arena's slab_pages list. Once they stayed empty
+// for purge_decay_ms they are released with MADV_DONTNEED, that wipes the
+// link in their header, so they are remembered by index on a global stack
+// instead, where any arena can pick them up again.
+static char *slab_base = NULL;
+static size_t slab_top = 0; // bytes of the reservation handed out
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+static uint32_t *purged_pages = NULL; // page indexes into the reservation
+static size_t purged_count = 0;
+static mem_lock purged_lock; // guards purged_pages and purged_count
+
+static mem_lock *purgedPagesLock(void) { return &purged_lock; }
+
+static void initSlabs(void)
+{
+	void *start = mmap(NULL, SLAB_RESERVE_SIZE, PROT_NONE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	// room for every page of the reservation, only the part in use is
+	// ever touched
+	void *stack =
+	    mmap(NULL, SLAB_RESERVE_SIZE / SLAB_PAGE_SIZE * sizeof(uint32_t),
+	         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+	         -1, 0);
+	if (stack != MAP_FAILED)
+		purged_pages = stack;
+
+	// without the reservation every request takes the block path
+	if (start != MAP_FAILED)
+		__atomic_store_n(&slab_base, start, __ATOMIC_RELEASE);
+}
+
+static inline bool isSlabPointer(void *ptr)
+{
+	char *base = __atomic_load_n(&slab_base, __ATOMIC_ACQUIRE);
+	return base && (char *)ptr >= base &&
+	       (char *)ptr < base + SLAB_RESERVE_SIZE;
+}
+
+static inline slab *slabOf(void *ptr)
+{
+	return (slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static inline char *slabData(slab *sl)
+{
+	return (char *)sl + ALIGN(sizeof(slab));
+}
+
+// Helper: unlink a slab from its class's partial list
+static void removeSlab(arena *ar, slab *sl, int cls)
+{
+	if (sl->prev)
+		sl->prev->next = sl->next;
+	else
+		ar->slabs[cls] = sl->next;
+
+	if (sl->next)
+		sl->next->prev = sl->prev;
+
+	sl->next = sl->prev = NULL;
+}
+
+static void pushSlab(arena *ar, slab *sl, int cls)
+{
+	sl->prev = NULL;
+	sl->next = ar->slabs[cls];
+	if (sl->next)
+		sl->next->prev = sl;
+	ar->slabs[cls] = sl;
+}
+
+// Helper: put an empty page on the arena's list, the newest goes first
+static void pushEmptyPage(arena *ar, slab *sl, uint64_t now)
+{
+	sl->magic = 0;
+	sl->freed_at = now;
+	sl->next = ar->slab_pages;
+	ar->slab_pages = sl;
+}
+
+// Helper: take a purged page back from the global stack, NULL if none. The
+// stack stays empty until initSlabs ran.
+static slab *popPurgedPage(void)
+{
+	slab *sl = NULL;
+
+	acquireLock(&purged_lock);
+	if (purged_count)
+		sl = (slab *)(slab_base +
+		              (size_t)purged_pages[--purged_count] * SLAB_PAGE_SIZE);
+	releaseLock(&purged_lock);
+
+	return sl;
+}
+
+// Release the pages that stayed on slab_pages for decay ms. The list is
+// ordered newest first, so those are a tail of it. Caller holds the arena
+// lock.
+static void purgeSlabPages(arena *ar, uint64_t now, uint64_t decay)
+{
+	if (!purged_pages)
+		return;
+
+	// pages freed after now was read count as young
+	slab **link = &ar->slab_pages;
+	while (*link && (*link)->freed_at + decay > now)
+		link = &(*link)->next;
+
+	slab *sl = *link;
+	if (!sl)
+		return;
+	*link = NULL;
+
+	// the indexes are read before madvise wipes the links, runs of
+	// neighbouring pages go to the kernel in one call
+	acquireLock(&purged_lock);
+	size_t first = purged_count;
+	for (; sl; sl = sl->next)
+		purged_pages[purged_count++] =
+		    (uint32_t)(((char *)sl - slab_base) / SLAB_PAGE_SIZE);
+
+	for (size_t i = first; i < purged_count;)
+	{
+		size_t run = 1;
+		while (i + run < purged_count &&
+		       purged_pages[i + run] == purged_pages[i] + run)
+			run++;
+		madvise(slab_base + (size_t)purged_pages[i] * SLAB_PAGE_SIZE,
+		        run * SLAB_PAGE_SIZE, MADV_DONTNEED);
+		i += run;
+	}
+	releaseLock(&purged_lock);
+}
+
+// Take an empty page from the arena, then from the purged ones, carving a
+// new chunk out of the slab reservation when there are none left
+static slab *newSlab(arena *ar, size_t obj_size)
+{
+	slab *sl = ar->slab_pages ? NULL : popPurgedPage();
+
+	if (!sl && !ar->slab_pages)
+	{
+		pthread_once(&slab_once, initSlabs);
+		if (!slab_base)
+			return NULL;
+
+		size_t offset =
+		    __atomic_fetch_add(&slab_top, SLAB_CHUNK_SIZE, __ATOMIC_RELAXED);
+		if (offset + SLAB_CHUNK_SIZE > SLAB_RESERVE_SIZE)
+			return NULL;
+
+		char *chunk = slab_base + offset;
+		if (mprotect(chunk, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE) != 0)
+			return NULL;
+		bindToNode(ar, chunk, SLAB_CHUNK_SIZE);
+		countMapped(SLAB_CHUNK_SIZE);
+
+		uint64_t now = nowMs();
+		for (size_t i = 0; i < SLAB_CHUNK_SIZE; i += SLAB_PAGE_SIZE)
+			pushEmptyPage(ar, (slab *)(chunk + i), now);
+	}
+
+	if (!sl)
+	{
+		sl = ar->slab_pages;
+		ar->slab_pages = sl->next;
+	}
+
+	sl->magic = (uint32_t)SLAB_MAGIC;
+	sl->arena_id = arenaId(ar);
+	sl->obj_size = obj_size;
+	sl->capacity =
+	    (SLAB_PAGE_SIZE - ALIGN(sizeof(slab))) / obj_size;
+	sl->free_count = sl->capacity;
+	sl->next = sl->prev = NULL;
+
+	memset(sl->free_map, 0, sizeof(sl->free_map));
+	for (uint32_t i = 0; i < sl->capacity; i++)
+		sl->free_map[i / 64] |= 1ull << (i % 64);
+
+	return sl;
+}
+
+// Allocate one object of size bytes (aligned, <= SLAB_MAX_SIZE), NULL if
+// the slab reservation is exhausted. Caller holds the arena lock.
+void *slabMalloc(arena *ar, size_t size)
+{
+	int cls = size / ALIGNMENT - 1;
+
+	if (__atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED))
+		drainRemoteFrees(ar);
+
+	slab *sl = ar->slabs[cls];
+	if (!sl)
+	{
+		sl = newSlab(ar, size);
+		if (!sl)
+			return NULL;
+		pushSlab(ar, sl, cls);
+	}
+
+	// find-first-set over the bitmap, a partial slab always has a free slot
+	int word = 0;
+	while (!sl->free_map[word])
+		word++;
+	int bit = __builtin_ctzll(sl->free_map[word]);
+
+	sl->free_map[word] &= ~(1ull << bit);
+	if (--sl->free_count == 0)
+		removeSlab(ar, sl, cls);
+
+	countAlloc(ar, sl->obj_size);
+	return slabData(sl) + (size_t)(word * 64 + bit) * sl->obj_size;
+}
+
+// Caller holds the lock of the slab's arena
+void slabFree(void *ptr)
+{
+	slab *sl = slabOf(ptr);
+
+	if (sl->magic != (uint32_t)SLAB_MAGIC)
+	{
+		fprintf(stderr, "[ERROR]: Invalid pointer or corrupted slab\n");
+		abort();
+	}
+
+	size_t offset = (char *)ptr - slabData(sl);
+	if ((char *)ptr < slabData(sl) || offset % sl->obj_size != 0)
+	{
+		fprintf(stderr,
+		        "[ERROR]: Pointer %p passed to free points into the middle "
+		        "of a slab object\n",
+		        ptr);
+		abort();
+	}
+
+	arena *ar = &arenas[sl->arena_id];
+	size_t slot = offset / sl->obj_size;
+	int cls = sl->obj_size / ALIGNMENT - 1;
+
+	if (sl->free_map[slot / 64] & (1ull << (slot % 64)))
+	{
+		fprintf(stderr, "[WARN]: Double free detected\n");
+		return;
+	}
+
+	sl->free_map[slot / 64] |= 1ull << (slot % 64);
+	sl->free_count++;
+	countFree(ar, sl->obj_size);
+
+	if (sl->free_count == 1)
+	{
+		// was full, usable again
+		pushSlab(ar, sl, cls);
+	}
+	else if (sl->free_count == sl->capacity &&
+	         (ar->slabs[cls] != sl || sl->next))
+	{
+		// empty and not the only slab of its class: the page can serve any
+		// class now
+		removeSlab(ar, sl, cls);
+		pushEmptyPage(ar, sl, nowMs());
+	}
+}
+
+// REMOTE FREES
+// A thread freeing memory of another arena does not take that arena's lock:
+// it pushes the pointer onto the arena's remote free list with a CAS, using
+// the first word of the object as the link. The arena's own threads detach
+// the whole list at once and free it in a batch on their next allocation.
+// An arena whose threads all exited has nobody left to do that, so the
+// freeing thread drains the list itself.
+void remoteFree(arena *ar, void *ptr)
+{
+	void *head = __atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED);
+
+	do
+		*(void **)ptr = head;
+	while (!__atomic_compare_exchange_n(&ar->remote_frees, &head, ptr, true,
+	                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	// pairs with tcacheDestroy: either the last thread's drain sees this
+	// push, or this load sees it gone
+	if (!__atomic_load_n(&ar->num_threads, __ATOMIC_SEQ_CST))
+	{
+		lockArena(ar);
+		drainRemoteFrees(ar);
+		unlockArena(ar);
+	}
+}
+
+// Free everything other threads have queued, caller holds the arena lock
+void drainRemoteFrees(arena *ar)
+{
+	void *ptr = __atomic_exchange_n(&ar->remote_frees, NULL, __ATOMIC_SEQ_CST);
+
+	while (ptr)
+	{
+		void *next = *(void **)ptr;
+
+		if (isSlabPointer(ptr))
+		{
+			slabFree(ptr);
+		}
+		else
+		{
+			struct block_header *block = (struct block_header *)ptr - 1;
+			clearCached(block);
+			heapFree(block);
+		}
+
+		ptr = next;
+	}
+}
+
+// Helper: Set an option the heaps are built around (the free-list index,
+// the page size). This only works while no arena has a heap yet. Every arena
+// is locked meanwhile and such options are only read under an arena lock.
+static int setBeforeFirstHeap(int *option, int value)
+{
+	int ok = 1;
+	for (int i = 0; i < MAX_ARENAS; i++)
+		lockArena(&arenas[i]);
+
+	for (int i = 0; i < MAX_ARENAS; i++)
+		if (arenas[i].regions)
+			ok = 0;
+	if (ok)
+		*option = value;
+
+	for (int i = MAX_ARENAS - 1; i >= 0; i--)
+		unlockArena(&arenas[i]);
+
+	return ok;
+}
+
+int _mallopt(int param, int value)
+{
+	switch (param)
+	{
+	case MEM_OPT_MMAP_THRESHOLD:
+		if (value <= 0)
+			return 0;
+		__atomic_store_n(&mmap_threshold, (size_t)value, __ATOMIC_RELAXED);
+		return 1;
+	case MEM_OPT_PURGE_DECAY_MS:
+		__atomic_store_n(&purge_decay_ms, value < 0 ? -1L : (long)value,
+		                 __ATOMIC_RELAXED);
+		return 1;
+	case MEM_OPT_DEFER_COALESCE:
+		__atomic_store_n(&defer_coalesce, value != 0, __ATOMIC_RELAXED);
+		return 1;
+	case MEM_OPT_FIT_STRATEGY:
+		if (value != MEM_FIT_SEGREGATED && value != MEM_FIT_TLSF)
+			return 0;
+		return setBeforeFirstHeap(&fit_strategy, value);
+	case MEM_OPT_HUGE_PAGES:
+		if (value < MEM_HUGE_OFF || value > MEM_HUGE_HUGETLB)
+			return 0;
+		return setBeforeFirstHeap(&huge_pages, value);
+	default:
+		return 0;
+	}
+}
+
+// THREAD CACHE
+// Each thread keeps a few recently freed small blocks per exact size. Blocks
+// in the cache stay allocated as far as the arena is concerned, so they
+// never coalesce, and carry BLOCK_CACHED to catch double frees.
+#define TCACHE_MAX_SIZE 1024
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT + 1)
+#define TCACHE_COUNT 32 // entries per bin before we flush
+#define TCACHE_BATCH 16 // blocks moved per refill / flush
+#define PURGE_TICKS 256 // allocations between decay checks, see purgeTick
+
+typedef struct tcache
+{
+	struct block_header *entries[TCACHE_BINS];
+	unsigned int counts[TCACHE_BINS];
+	arena *arena;    // arena this thread allocates from
+	unsigned int purge_ticks;
+	int pool_slot;   // index into mem_pool.caches + 1, 0 = none yet, see
+	                 // poolCache
+	bool registered; // thread exit destructor armed
+	bool disabled;   // thread is exiting, bypass the cache
+} tcache;
+
+static _Thread_local tcache thread_cache;
+static void releasePoolSlot(tcache *tc);
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static void tcachePush(tcache *tc, int bin, struct block_header *block)
+{
+	setCached(block);
+	LINKS(block)->next_free = tc->entries[bin];
+	tc->entries[bin] = block;
+	tc->counts[bin]++;
+}
+
+static struct block_header *tcachePop(tcache *tc, int bin)
+{
+	struct block_header *block = tc->entries[bin];
+
+	tc->entries[bin] = LINKS(block)->next_free;
+	tc->counts[bin]--;
+
+	clearCached(block);
+	return block;
+}
+
+// Move up to count blocks of one bin back to the arena under a single lock,
+// the cache only ever holds blocks of the thread's own arena
+static void tcacheFlush(tcache *tc, int bin, unsigned int count)
+{
+	lockArena(tc->arena);
+	while (count-- && tc->entries[bin])
+		heapFree(tcachePop(tc, bin));
+	unlockArena(tc->arena);
+}
+
+#ifdef MEM_LATENCY
+static void latencyRetire(void);
+#endif
+
+// pthread key destructor: hand everything back when the thread exits
+static void tcacheDestroy(void *arg)
+{
+	tcache *tc = arg;
+
+	tc->disabled = true;
+	for (int bin = 0; bin < TCACHE_BINS; bin++)
+		tcacheFlush(tc, bin, tc->counts[bin]);
+
+	// keep tc->arena for allocations made by later destructors, but stop
+	// counting this thread as a user. The last one out frees what is
+	// queued, later remote frees see no threads and free directly.
+	__atomic_fetch_sub(&tc->arena->num_threads, 1, __ATOMIC_SEQ_CST);
+	lockArena(tc->arena);
+	drainRemoteFrees(tc->arena);
+	unlockArena(tc->arena);
+
+	releasePoolSlot(tc);
+#ifdef MEM_LATENCY
+	latencyRetire();
+#endif
+}
+
+static void tcacheCreateKey(void)
+{
+	pthread_key_create(&tcache_key, tcacheDestroy);
+}
+
+// Attach the thread to the arena with the fewest threads, among the arenas
+// of its node on NUMA machines. Ties go to the lowest index, so with no
+// thread exits this is plain round-robin.
+static arena *pickArena(void)
+{
+	pthread_once(&arenas_once, initArenas);
+
+	int node = numa_nodes ? currentNode() : -1;
+	arena *best = NULL;
+	for (int i = 0; i < num_arenas; i++)
+	{
+		if (node >= 0 && arenas[i].node != node)
+			continue;
+		if (!best ||
+		    __atomic_load_n(&arenas[i].num_threads, __ATOMIC_RELAXED) <
+		        __atomic_load_n(&best->num_threads, __ATOMIC_RELAXED))
+			best = &arenas[i];
+	}
+
+	__atomic_fetch_add(&best->num_threads, 1, __ATOMIC_RELAXED);
+	return best;
+}
+
+static tcache *getThreadCache(void)
+{
+	tcache *tc = &thread_cache;
+
+	if (!tc->registered)
+	{
+		tc->arena = pickArena();
+		pthread_once(&tcache_key_once, tcacheCreateKey);
+		pthread_setspecific(tcache_key, tc);
+		tc->registered = true;
+	}
+
+	return tc;
+}
+
+// Frees only check the decay clock when they leave a free block of a page
+// or more, which a workload served by the thread caches and slabs never
+// does. Allocations check it too, every PURGE_TICKS per thread, and only
+// take the lock once a purge is due.
+static void purgeTick(tcache *tc)
+{
+	if (++tc->purge_ticks % PURGE_TICKS)
+		return;
+
+	arena *ar = tc->arena;
+	long decay = __atomic_load_n(&purge_decay_ms, __ATOMIC_RELAXED);
+	uint64_t now = nowMs();
+	if (decay < 0 ||
+	    now - __atomic_load_n(&ar->last_purge, __ATOMIC_RELAXED) <
+	        (uint64_t)decay / 2)
+		return;
+
+	lockArena(ar);
+	maybePurgeArena(ar, now);
+	unlockArena(ar);
+}
+
+// Grab a batch of blocks for one bin under a single lock, return one of them.
+// The batch stops short when the heap cannot grow, NULL if not even one
+// block was left.
+static void *tcacheRefill(tcache *tc, int bin, size_t length)
+{
+	arena *ar = tc->arena;
+
+	lockArena(ar);
+	void *ptr = heapMalloc(ar, length);
+	for (int i = 1; ptr && i < TCACHE_BATCH; i++)
+	{
+		void *next = heapMalloc(ar, length);
+		if (!next)
+			break;
+		tcachePush(tc, bin, (struct block_header *)ptr - 1);
+		ptr = next;
+	}
+	unlockArena(ar);
+
+	return ptr;
+}
+
+// POOLS
+// A pool hands out objects of one size with no header, carved from chunks
+// like a region's (see newChunk) and recycled through intrusive free lists.
+// Every thread owns a slot of mem_pool.caches in all pools and keeps up to
+// POOL_CACHE_MAX free objects there, so most calls take no lock. Objects
+// beyond that, and those of threads without a slot, go to the shared list
+// under the pool lock. A slot is handed to a new thread when its owner exits,
+// together with whatever objects it still caches.
+static uint64_t pool_slots = 0; // bit i set <=> slot i is owned by a thread
+static mem_pool *all_pools = NULL;
+static mem_lock pools_lock; // guards all_pools
+
+static void lockPools(void)
+{
+	acquireLock(&pools_lock);
+	for (mem_pool *pool = all_pools; pool; pool = pool->next)
+		acquireLock(&pool->lock);
+}
+
+static void unlockPools(void)
+{
+	for (mem_pool *pool = all_pools; pool; pool = pool->next)
+		releaseLock(&pool->lock);
+	releaseLock(&pools_lock);
+}
+
+static void resetPoolLocks(void)
+{
+	for (mem_pool *pool = all_pools; pool; pool = pool->next)
+		pool->lock.state = 0;
+	pools_lock.state = 0;
+}
+
+// Helper: The calling thread's cache in a pool, NULL if all slots are taken
+static inline pool_cache *poolCache(mem_pool *pool)
+{
+	tcache *tc = &thread_cache;
+
+	if (tc->pool_slot > 0)
+		return &pool->caches[tc->pool_slot - 1];
+	if (tc->pool_slot < 0 || tc->disabled)
+		return NULL;
+
+	getThreadCache(); // arms the destructor that gives the slot back
+	uint64_t used = __atomic_load_n(&pool_slots, __ATOMIC_RELAXED);
+	while (~used)
+	{
+		int slot = __builtin_ctzll(~used);
+		if (__atomic_compare_exchange_n(&pool_slots, &used,
+		                                used | (1ULL << slot), true,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			tc->pool_slot = slot + 1;
+			return &pool->caches[slot];
+		}
+	}
+
+	tc->pool_slot = -1; // more than POOL_MAX_THREADS threads
+	return NULL;
+}
+
+static void releasePoolSlot(tcache *tc)
+{
+	if (tc->pool_slot > 0)
+		__atomic_fetch_and(&pool_slots, ~(1ULL << (tc->pool_slot - 1)),
+		                   __ATOMIC_RELEASE);
+	tc->pool_slot = 0;
+}
+
+// align 0 means ALIGNMENT, otherwise it must be a power of two. Returns NULL
+// for a bad alignment or objects over REGION_MAX_CHUNK.
+mem_pool *_pool_create(size_t obj_size, size_t align)
+{
+	if (!align)
+		align = ALIGNMENT;
+	if ((align & (align - 1)) || align > REGION_MAX_CHUNK ||
+	    obj_size > REGION_MAX_CHUNK)
+		return NULL;
+
+	// every free object holds the link to the next one
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+
+	mem_pool *pool = _aligned_alloc(_Alignof(mem_pool), sizeof(mem_pool));
+	if (!pool)
+		return NULL;
+
+	memset(pool, 0, sizeof(mem_pool));
+	pool->obj_size = (obj_size + align - 1) & ~(align - 1);
+	pool->align = align;
+	pool->chunk_size = REGION_MIN_CHUNK / 2;
+
+	acquireLock(&pools_lock);
+	pool->next = all_pools;
+	if (all_pools)
+		all_pools->prev = pool;
+	all_pools = pool;
+	releaseLock(&pools_lock);
+
+	return pool;
+}
+
+// Helper: Carve a fresh object off the newest chunk, NULL if no new chunk
+// could be mapped. The caller holds the pool lock.
+static void *poolCarve(mem_pool *pool)
+{
+	if ((size_t)(pool->end - pool->top) < pool->obj_size)
+	{
+		size_t chunk_size = pool->chunk_size < REGION_MAX_CHUNK
+		                        ? pool->chunk_size * 2
+		                        : REGION_MAX_CHUNK;
+		if (chunk_size < POOL_BATCH * pool->obj_size)
+			chunk_size = POOL_BATCH * pool->obj_size;
+
+		region_chunk *chunk = newChunk(chunk_size + pool->align);
+		if (!chunk)
+			return NULL;
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+		pool->chunk_size = chunk_size;
+
+		uintptr_t first = (uintptr_t)(chunk + 1);
+		pool->top = (char *)((first + pool->align - 1) & ~(pool->align - 1));
+		pool->end = chunk->end;
+	}
+
+	void *obj = pool->top;
+	pool->top += pool->obj_size;
+	return obj;
+}
+
+// Helper: Take one object from the shared list or a new chunk, and a batch
+// more for the thread's cache while the lock is held
+static void *poolRefill(mem_pool *pool, pool_cache *pc)
+{
+	acquireLock(&pool->lock);
+
+	// the cache is empty, append so fresh objects come out in address order
+	int batch = pc ? POOL_BATCH : 1;
+	void **tail = pc ? &pc->head : NULL;
+	void *obj = NULL;
+	for (int i = 0; i < batch; i++)
+	{
+		void *next;
+		if (pool->free_list)
+		{
+			next = pool->free_list;
+			pool->free_list = *(void **)next;
+		}
+		else if (!(next = poolCarve(pool)))
+		{
+			break; // out of memory, keep what we have
+		}
+
+		if (!obj)
+		{
+			obj = next;
+			continue;
+		}
+		*tail = next;
+		tail = (void **)next;
+		pc->count++;
+	}
+	if (tail)
+		*tail = NULL;
+
+	releaseLock(&pool->lock);
+	return obj;
+}
+
+// O(1): the thread's cache, otherwise a batch under the pool lock
+void *_pool_alloc(mem_pool *pool)
+{
+	pool_cache *pc = poolCache(pool);
 
-	if (free_list)
+	if (pc && pc->head)
 	{
-		free_list->prev_free = block;
+		void *obj = pc->head;
+		pc->head = *(void **)obj;
+		pc->count--;
+		return obj;
 	}
 
-	free_list = block;
+	return poolRefill(pool, pc);
 }
 
-// Helper: Remove block from the free list
-void removeFromFreeList(struct block_header *block)
+// obj must come from _pool_alloc of the same pool, any thread may free it
+void _pool_free(mem_pool *pool, void *obj)
 {
-	if (!block)
+	if (!obj)
 		return;
 
-	if (block->prev_free)
+	pool_cache *pc = poolCache(pool);
+	if (pc && pc->count < POOL_CACHE_MAX)
 	{
-		block->prev_free->next_free = block->next_free;
-	}
-	else
-	{
-		free_list = block->next_free;
+		*(void **)obj = pc->head;
+		pc->head = obj;
+		pc->count++;
+		return;
 	}
 
-	if (block->next_free)
+	// cache full: hand it over together with a batch of the cache
+	acquireLock(&pool->lock);
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	for (int i = 0; pc && i < POOL_BATCH; i++)
 	{
-		block->next_free->prev_free = block->prev_free;
-	}
+		void *next = pc->head;
+		pc->head = *(void **)next;
+		pc->count--;
 
-	block->next_free = NULL;
-	block->prev_free = NULL;
+		*(void **)next = pool->free_list;
+		pool->free_list = next;
+	}
+	releaseLock(&pool->lock);
 }
 
-// create a new page and initialize a header and return it
-struct block_header *getHeap(size_t size)
+// Unmaps every chunk, objects still in use or cached by any thread included
+void _pool_destroy(mem_pool *pool)
 {
-	size_t page_size = sysconf(_SC_PAGESIZE);
-
-	size_t required = size + ALIGNED_BLOCK_SIZE;
-	int num_pages = (required + page_size - 1) / page_size;
-	size_t total_size = num_pages * page_size;
+	if (!pool)
+		return;
 
-	void *start = mmap(NULL, total_size, PROT_WRITE | PROT_READ,
-	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	// printf("DEBUG: mmap returned %p\n", start);
+	acquireLock(&pools_lock);
+	if (pool->prev)
+		pool->prev->next = pool->next;
+	else
+		all_pools = pool->next;
+	if (pool->next)
+		pool->next->prev = pool->prev;
+	releaseLock(&pools_lock);
 
-	if (start == MAP_FAILED)
+	for (region_chunk *chunk = pool->chunks, *next; chunk; chunk = next)
 	{
-		perror("Map failed");
-		exit(1);
+		next = chunk->next;
+		freeChunk(chunk);
 	}
 
-	struct block_header *header = (struct block_header *)start;
-
-	header->size = total_size - ALIGNED_BLOCK_SIZE;
-	header->is_free = true;
-	header->magic = BLOCK_MAGIC;
-
-	header->prev = NULL;
-	header->next = NULL;
-
-	// Initialize free pointers but don't add to list yet (caller does it)
-	header->next_free = NULL;
-	header->prev_free = NULL;
-
-	return header;
+	_free(pool);
 }
 
-void initHeap(void)
+// LATENCY HISTOGRAMS
+// Built with MEM_LATENCY, the public calls time themselves and count the
+// nanoseconds in per-thread log-linear histograms: below 16 ns every value
+// has its own bucket, above that each power of two is split into 16, so a
+// bucket is at most 1/16 wide. A thread takes a histogram on its first call,
+// one an exited thread left or a new mapping. On exit its counts are folded
+// into latency_exited, so there are never more histograms than threads were
+// alive at once. _latency adds up all of them.
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_MAX_LOG2 40 // ~18 minutes, anything slower lands in the last
+#define LAT_BUCKETS ((LAT_MAX_LOG2 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+typedef struct latency_hist
 {
-	if (!lock_initialized)
-	{
-		pthread_mutexattr_t attr;
-		pthread_mutexattr_init(&attr);
-		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-		pthread_mutex_init(&global_malloc_lock, &attr);
-		pthread_mutexattr_destroy(&attr);
-		lock_initialized = true;
-	}
-
-	size_t page_size = sysconf(_SC_PAGESIZE);
-	struct block_header *header = getHeap(page_size);
-	block_list = header;
-
-	// Add initial block to free list
-	addToFreeList(header);
-}
-
-// NOTE: requires the current block to be in the free_list
-void coalesce(struct block_header *current)
+	uint64_t buckets[MEM_LAT_OPS][LAT_BUCKETS];
+	uint64_t total_ns[MEM_LAT_OPS];
+	uint64_t max_ns[MEM_LAT_OPS];
+	int owned;                 // a thread records into it
+	struct latency_hist *next; // all histograms ever created
+} latency_hist;
+
+// counts of the threads that exited, always owned so nobody claims it
+static latency_hist latency_exited = {.owned = 1};
+static latency_hist *latency_list = &latency_exited;
+
+// Helper: Highest latency that falls into a bucket
+static uint64_t latencyBucketMax(int bucket)
 {
-	// MERGE WITH NEXT
-	// Check if the next block exists, is free, and is physically adjacent
-	if (current->next && current->next->is_free &&
-	    (char *)current + ALIGNED_BLOCK_SIZE + current->size ==
-	        (char *)current->next)
-	{
-		struct block_header *next_block = current->next;
-
-		// IMPORTANT: Remove the absorbed block from the free list first
-		removeFromFreeList(next_block);
-
-		current->size += next_block->size + ALIGNED_BLOCK_SIZE;
-		current->next = next_block->next;
-
-		if (next_block->next)
-			next_block->next->prev = current;
-
-		// next_block is now garbage
-	}
+	if (bucket < LAT_SUB)
+		return (uint64_t)bucket;
 
-	// MERGE WITH PREV
-	// Check if the prev block exists, is free, and is physically adjacent
-	if (current->prev && current->prev->is_free &&
-	    (char *)current->prev + ALIGNED_BLOCK_SIZE + current->prev->size ==
-	        (char *)current)
-	{
-		struct block_header *prev_block = current->prev;
+	int shift = bucket / LAT_SUB - 1;
+	uint64_t sub = (uint64_t)(bucket % LAT_SUB);
+	return ((LAT_SUB + sub + 1) << shift) - 1;
+}
 
-		// IMPORTANT: Remove the absorbed block (current) from the free list
-		removeFromFreeList(current);
+#ifdef MEM_LATENCY
+static _Thread_local latency_hist *thread_latency = NULL;
+static _Thread_local bool latency_retired = false;
 
-		prev_block->size += current->size + ALIGNED_BLOCK_SIZE;
-		prev_block->next = current->next;
+// Helper: Map a latency to its histogram bucket
+static int latencyBucket(uint64_t ns)
+{
+	if (ns < LAT_SUB)
+		return (int)ns;
 
-		if (current->next)
-			current->next->prev = prev_block;
+	int log2 = 63 - __builtin_clzll(ns);
+	if (log2 >= LAT_MAX_LOG2)
+		return LAT_BUCKETS - 1;
 
-		// current is now garbage, we should return the merged block if needed
-		// but since we don't return anything, it's fine.
-	}
+	return (log2 - LAT_SUB_BITS + 1) * LAT_SUB +
+	       (int)((ns >> (log2 - LAT_SUB_BITS)) & (LAT_SUB - 1));
 }
 
-void validate_list(void)
+static inline uint64_t latencyClock(void)
 {
-	struct block_header *walk = block_list;
-	int count = 0;
-	while (walk)
-	{
-		if (walk->magic != BLOCK_MAGIC)
-		{
-			printf("[ERROR] Corrupted block at %p, magic=%zx\n", (void *)walk,
-			       walk->magic);
-			abort();
-		}
-		walk = walk->next;
-		count++;
-	}
-	// printf("List validated: %d blocks\n\n", count);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
-void expandHeap(size_t min_size)
+// Helper: counters are only written by their thread, but read by _latency
+static inline void latencyAdd(uint64_t *counter, uint64_t value)
 {
-	// find the last block in the physical list
-	struct block_header *current = block_list;
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+	                 __ATOMIC_RELAXED);
+}
 
-	if (!block_list)
+// Helper: take a histogram an exited thread left, or map a new one. NULL if
+// the mapping fails, the thread then goes untimed.
+static latency_hist *latencyClaim(void)
+{
+	latency_hist *hist;
+	for (hist = __atomic_load_n(&latency_list, __ATOMIC_ACQUIRE); hist;
+	     hist = hist->next)
 	{
-		initHeap();
-		return;
+		int unowned = 0;
+		if (__atomic_compare_exchange_n(&hist->owned, &unowned, 1, false,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
 	}
 
-	while (current->next)
-		current = current->next;
-
-	struct block_header *new_page_block = getHeap(min_size);
-
-	// attach the last block with the new page block
-	current->next = new_page_block;
-	new_page_block->prev = current;
-
-	// Add new block to free list
-	addToFreeList(new_page_block);
-
-	// Try to coalesce with the previous block (which is 'current')
-	// if 'current' was free, they will merge.
-	// We call coalesce on the *left* block essentially, or we can call it on
-	// new_page_block simpler to call on new_page_block and let it merge left.
-	coalesce(new_page_block);
+	if (!hist)
+	{
+		// mapped directly, it is neither heap nor counted in _mallinfo
+		hist = mmap(NULL, sizeof(latency_hist), PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (hist == MAP_FAILED)
+			return NULL;
+
+		hist->owned = 1;
+		hist->next = __atomic_load_n(&latency_list, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&latency_list, &hist->next, hist,
+		                                    true, __ATOMIC_RELEASE,
+		                                    __ATOMIC_RELAXED))
+			;
+	}
 
-	// validate_list();
+	thread_latency = hist;
+	return hist;
 }
 
-void *_malloc(size_t length)
+static void latencyRecord(int op, uint64_t start)
 {
-	if (!lock_initialized)
-		initHeap();
-	pthread_mutex_lock(&global_malloc_lock);
+	uint64_t ns = latencyClock() - start;
+	latency_hist *hist = thread_latency;
 
-	if (!block_list)
-		initHeap();
+	if (!hist && !latency_retired)
+		hist = latencyClaim();
+	if (!hist)
+		return;
 
-	// align the length
-	length = ALIGN(length);
+	latencyAdd(&hist->buckets[op][latencyBucket(ns)], 1);
+	latencyAdd(&hist->total_ns[op], ns);
+	if (ns > hist->max_ns[op])
+		__atomic_store_n(&hist->max_ns[op], ns, __ATOMIC_RELAXED);
+}
 
-	struct block_header *current = free_list;
+// Fold the exiting thread's counts into latency_exited and leave its
+// histogram, zeroed, for the next thread. Calls made by later destructors
+// are not timed. Meanwhile _latency may count the folded calls twice.
+static void latencyRetire(void)
+{
+	latency_hist *hist = thread_latency;
+	thread_latency = NULL;
+	latency_retired = true;
+	if (!hist)
+		return;
 
-	while (current)
+	for (int op = 0; op < MEM_LAT_OPS; op++)
 	{
-		// skip if cant allocate in this block
-		if (current->size < length)
+		for (int i = 0; i < LAT_BUCKETS; i++)
 		{
-			current = current->next_free;
-			continue;
+			uint64_t n = hist->buckets[op][i];
+			if (!n)
+				continue;
+			__atomic_fetch_add(&latency_exited.buckets[op][i], n,
+			                   __ATOMIC_RELAXED);
+			__atomic_store_n(&hist->buckets[op][i], 0, __ATOMIC_RELAXED);
 		}
 
-		// allocate memory
-		current->is_free = false;
+		__atomic_fetch_add(&latency_exited.total_ns[op], hist->total_ns[op],
+		                   __ATOMIC_RELAXED);
+		__atomic_store_n(&hist->total_ns[op], 0, __ATOMIC_RELAXED);
+
+		uint64_t max_ns = hist->max_ns[op];
+		uint64_t seen =
+		    __atomic_load_n(&latency_exited.max_ns[op], __ATOMIC_RELAXED);
+		while (max_ns > seen &&
+		       !__atomic_compare_exchange_n(&latency_exited.max_ns[op], &seen,
+		                                    max_ns, true, __ATOMIC_RELAXED,
+		                                    __ATOMIC_RELAXED))
+			;
+		__atomic_store_n(&hist->max_ns[op], 0, __ATOMIC_RELAXED);
+	}
 
-		// IMPORTANT: Remove from free list first
-		removeFromFreeList(current);
+	__atomic_store_n(&hist->owned, 0, __ATOMIC_RELEASE);
+}
 
-		// split block logic
-		size_t remaining = current->size - length;
-		if (remaining >= ALIGNED_BLOCK_SIZE + MIN_HEADER_SIZE)
-		{
-			// get pointer to data area (right after the header)
-			void *data_start = (void *)(current + 1);
+#define LATENCY_START() uint64_t latency_start = latencyClock()
+#define LATENCY_STOP(op) latencyRecord(op, latency_start)
+#else
+#define LATENCY_START()
+#define LATENCY_STOP(op)
+#endif
 
-			// create the new header for the split part
-			struct block_header *new_block =
-			    (struct block_header *)((char *)data_start + length);
+static void *mallocImpl(size_t length)
+{
+	if (length > MAX_REQUEST)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
 
-			// Update physical links
-			new_block->next = current->next;
-			current->next = new_block;
+	// tiny objects go to the slabs, no header at all
+	if (length <= SLAB_MAX_SIZE)
+	{
+		tcache *tc = getThreadCache();
+		purgeTick(tc);
+		arena *ar = tc->arena;
 
-			new_block->prev = current;
-			if (new_block->next)
-				new_block->next->prev = new_block;
+		lockArena(ar);
+		void *ptr = slabMalloc(ar, length ? ALIGN(length) : ALIGNMENT);
+		unlockArena(ar);
 
-			// Setup new block
-			new_block->is_free = true;
-			new_block->magic = BLOCK_MAGIC;
-			new_block->size = remaining - ALIGNED_BLOCK_SIZE;
-			current->size = length;
+		if (ptr)
+			return ptr;
+	}
 
-			// Add new block to free list
-			addToFreeList(new_block);
-		}
+	// align the length, every block must be able to hold the free links
+	length = ALIGN(length);
+	if (length < (size_t)MIN_HEADER_SIZE)
+		length = MIN_HEADER_SIZE;
 
-		// return pointer to data section (skip the header)
-		pthread_mutex_unlock(&global_malloc_lock);
-		return (void *)(current + 1);
+	if (length >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+		return mmapMalloc(length);
+
+	tcache *tc = getThreadCache();
+	purgeTick(tc);
+	if (tc->disabled || length > TCACHE_MAX_SIZE)
+	{
+		lockArena(tc->arena);
+		void *ptr = heapMalloc(tc->arena, length);
+		unlockArena(tc->arena);
+		if (!ptr)
+			errno = ENOMEM;
+		return ptr;
 	}
 
-	// if no space found, expand heap and try again recursively
-	expandHeap(length);
-	void *ptr = _malloc(length);
-	pthread_mutex_unlock(&global_malloc_lock);
+	// fast path: no lock at all
+	int bin = length / ALIGNMENT;
+	if (tc->entries[bin])
+		return (void *)(tcachePop(tc, bin) + 1);
+
+	void *ptr = tcacheRefill(tc, bin, length);
+	if (!ptr)
+		errno = ENOMEM;
 	return ptr;
 }
 
-void _free(void *data)
+static void freeImpl(void *data)
 {
-	pthread_mutex_lock(&global_malloc_lock);
-
 	if (!data)
-	{
-		pthread_mutex_unlock(&global_malloc_lock);
 		return;
-	}
 
 	// 1. alignment check: Pointers from malloc are always aligned.
 	if (((size_t)data & (ALIGNMENT - 1)) != 0)
@@ -307,138 +2630,243 @@ void _free(void *data)
 		abort();
 	}
 
+	if (isSlabPointer(data))
+	{
+		arena *owner = &arenas[slabOf(data)->arena_id];
+		if (owner != getThreadCache()->arena)
+		{
+			remoteFree(owner, data);
+			return;
+		}
+
+		lockArena(owner);
+		slabFree(data);
+		unlockArena(owner);
+		return;
+	}
+
 	struct block_header *current = (struct block_header *)data - 1;
 
 	// 2. magic number check: The header magic must match.
-	if (current->magic != BLOCK_MAGIC)
+	if (current->magic != (uint32_t)BLOCK_MAGIC)
 	{
 		fprintf(stderr, "[ERROR]: Invalid pointer or corrupted block\n");
 		abort();
 	}
 
-	if (current->is_free)
+	if (current->size & (BLOCK_FREE | BLOCK_CACHED))
 	{
 		fprintf(stderr, "[WARN]: Double free detected\n");
-		pthread_mutex_unlock(&global_malloc_lock);
 		return;
 	}
 
-	current->is_free = true;
+	if (current->arena_id == NO_ARENA)
+	{
+		mmapFree(current);
+		return;
+	}
 
-	// Add to free list (LIFO)
-	addToFreeList(current);
+	// another arena's block goes back through its remote free list, queued
+	// blocks count as cached so freeing them again is caught
+	tcache *tc = getThreadCache();
+	arena *owner = &arenas[current->arena_id];
+	if (owner != tc->arena)
+	{
+		setCached(current);
+		remoteFree(owner, data);
+		return;
+	}
 
-	// Coalesce physically
-	coalesce(current);
+	size_t size = blockSize(current);
+	if (tc->disabled || size > TCACHE_MAX_SIZE)
+	{
+		lockArena(owner);
+		heapFree(current);
+		unlockArena(owner);
+		return;
+	}
 
-	pthread_mutex_unlock(&global_malloc_lock);
+	// fast path: keep it for this thread, spill half when the bin is full
+	int bin = size / ALIGNMENT;
+	tcachePush(tc, bin, current);
+	if (tc->counts[bin] > TCACHE_COUNT)
+		tcacheFlush(tc, bin, TCACHE_COUNT / 2);
 }
 
-void *_calloc(size_t num, size_t size)
+static void *callocImpl(size_t num, size_t size)
 {
-	pthread_mutex_lock(&global_malloc_lock);
-	size_t total = num * size;
-
-	// check for overflow
-	if (num != 0 && total / num != size)
+	size_t total;
+	if (__builtin_mul_overflow(num, size, &total) || total > MAX_REQUEST)
 	{
-		fprintf(stderr, "[ERROR]: Integer overflow during calloc\n");
-		pthread_mutex_unlock(&global_malloc_lock);
+		errno = ENOMEM;
 		return NULL;
 	}
 
+	size_t length = ALIGN(total);
+	if (length < (size_t)MIN_HEADER_SIZE)
+		length = MIN_HEADER_SIZE;
+
+	// a fresh mapping is zero already, its pages fault in lazily
+	if (length >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+		return mmapMalloc(length);
+
+	// blocks above the thread cache may span pages that were never touched
+	// or got purged, only clear the rest
+	if (length > TCACHE_MAX_SIZE)
+	{
+		arena *ar = getThreadCache()->arena;
+		size_t clean_from, clean_to;
+
+		lockArena(ar);
+		char *data = heapCalloc(ar, length, &clean_from, &clean_to);
+		unlockArena(ar);
+
+		if (!data)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		memset(data, 0, clean_from < total ? clean_from : total);
+		if (clean_to < total)
+			memset(data + clean_to, 0, total - clean_to);
+
+		return data;
+	}
+
 	// initialize the memory
-	void *data = _malloc(total);
+	void *data = mallocImpl(total);
 
 	if (!data)
 	{
 		fprintf(stderr, "[ERROR]: _malloc failed!\n");
-		pthread_mutex_unlock(&global_malloc_lock);
 		return NULL;
 	}
 
 	// set initial values to 0
 	memset(data, 0, total);
 
-	pthread_mutex_unlock(&global_malloc_lock);
 	return data;
 }
 
-void *_realloc(void *ptr, size_t size)
+static void *reallocImpl(void *ptr, size_t size)
 {
-	pthread_mutex_lock(&global_malloc_lock);
+	// ptr stays valid, as after any failed realloc
+	if (size > MAX_REQUEST)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
 	size = ALIGN(size);
 
 	// explicitly allowed
 	if (!ptr)
-	{
-		void *res = _malloc(size);
-		pthread_mutex_unlock(&global_malloc_lock);
-		return res;
-	}
+		return mallocImpl(size);
 
 	// a valid pointer and a size == 0 is equivalent to free(ptr)
 	if (size == 0)
 	{
-		_free(ptr);
-		pthread_mutex_unlock(&global_malloc_lock);
+		freeImpl(ptr);
 		return NULL;
 	}
 
+	// slab objects cannot grow, they move once they no longer fit
+	if (isSlabPointer(ptr))
+	{
+		size_t obj_size = slabOf(ptr)->obj_size;
+		if (size <= obj_size)
+			return ptr;
+
+		void *new_ptr = mallocImpl(size);
+		if (!new_ptr)
+		{
+			fprintf(stderr, "[ERROR]: _malloc failed!\n");
+			return NULL;
+		}
+
+		memcpy(new_ptr, ptr, obj_size);
+		freeImpl(ptr);
+		return new_ptr;
+	}
+
+	if (size < (size_t)MIN_HEADER_SIZE)
+		size = MIN_HEADER_SIZE;
+
 	struct block_header *block = (struct block_header *)ptr - 1;
-	size_t current_size = block->size;
+	size_t current_size = blockSize(block);
 
 	// check if the pointer can be realloc'ed
-	if (block->magic != BLOCK_MAGIC)
+	if (block->magic != (uint32_t)BLOCK_MAGIC)
 	{
 		fprintf(stderr, "[ERROR]: Invalid pointer\n");
-		pthread_mutex_unlock(&global_malloc_lock);
 		return NULL;
 	}
 
+	// a mapping is only ever replaced as a whole, keep it while it fits
+	if (block->arena_id == NO_ARENA && current_size >= size)
+		return ptr;
+
 	// if current block is big enough, return it
-	if (current_size > size)
+	if (current_size >= size)
 	{
 		// Should we split?
 		size_t remaining = current_size - size;
 		if (remaining >= ALIGNED_BLOCK_SIZE + MIN_HEADER_SIZE)
 		{
+			arena *ar = &arenas[block->arena_id];
+			lockArena(ar);
+
 			// 1. Calculate split point
 			void *data_start = (void *)(block + 1);
 			struct block_header *new_block =
 			    (struct block_header *)((char *)data_start + size);
 
 			// 2. Setup new block header
-			new_block->magic = BLOCK_MAGIC;
-			new_block->is_free = true;
-			new_block->size = remaining - ALIGNED_BLOCK_SIZE;
+			initHeader(new_block, remaining - ALIGNED_BLOCK_SIZE,
+			           block->arena_id);
 
-			// 3. Update physical links
-			new_block->next = block->next;
-			block->next = new_block;
+			// 3. Update current block size, flags stay
+			block->size = size | (block->size & BLOCK_FLAGS);
+			countFree(ar, remaining);
 
-			new_block->prev = block;
-			if (new_block->next)
-				new_block->next->prev = new_block;
+			// 4. Add new block to free list and coalesce
+			markFree(new_block);
+			addToFreeList(ar, new_block);
+			coalesce(ar, new_block);
 
-			// 4. Update current block size
-			block->size = size;
-
-			// 5. Add new block to free list and coalesce
-			addToFreeList(new_block);
-			coalesce(new_block);
+			unlockArena(ar);
 		}
 
-		pthread_mutex_unlock(&global_malloc_lock);
 		return ptr;
 	}
 
+	// a mapping grows through mremap, nothing is copied
+	if (block->arena_id == NO_ARENA)
+	{
+		struct block_header *moved = mmapRealloc(block, size);
+		return moved ? (void *)(moved + 1) : NULL;
+	}
+
+	// grow in place while below the mmap threshold, bigger blocks move to
+	// their own mapping so later growth can use mremap
+	if (size < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+	{
+		arena *ar = &arenas[block->arena_id];
+
+		lockArena(ar);
+		bool grown = heapGrow(ar, block, size);
+		unlockArena(ar);
+
+		if (grown)
+			return ptr;
+	}
+
 	// allocate the space and verify if it worked
-	void *new_ptr = _malloc(size);
+	void *new_ptr = mallocImpl(size);
 	if (!new_ptr)
 	{
 		fprintf(stderr, "[ERROR]: _malloc failed!\n");
-		pthread_mutex_unlock(&global_malloc_lock);
 		return NULL;
 	}
 
@@ -447,8 +2875,254 @@ void *_realloc(void *ptr, size_t size)
 	memcpy(new_ptr, ptr, min_size);
 
 	// free the original memory
-	_free(ptr);
+	freeImpl(ptr);
+
+	return new_ptr;
+}
+
+void *_malloc(size_t length)
+{
+	LATENCY_START();
+	void *ptr = mallocImpl(length);
+	LATENCY_STOP(MEM_LAT_MALLOC);
+	return ptr;
+}
+
+void _free(void *data)
+{
+	LATENCY_START();
+	freeImpl(data);
+	LATENCY_STOP(MEM_LAT_FREE);
+}
+
+void *_calloc(size_t num, size_t size)
+{
+	LATENCY_START();
+	void *ptr = callocImpl(num, size);
+	LATENCY_STOP(MEM_LAT_CALLOC);
+	return ptr;
+}
 
-	pthread_mutex_unlock(&global_malloc_lock);
+void *_realloc(void *ptr, size_t size)
+{
+	LATENCY_START();
+	void *new_ptr = reallocImpl(ptr, size);
+	LATENCY_STOP(MEM_LAT_REALLOC);
 	return new_ptr;
 }
+
+// ALIGNED ALLOCATION
+// alignment 0 (or anything up to ALIGNMENT) is a plain _malloc, as in glibc
+void *_memalign(size_t alignment, size_t size)
+{
+	// round any other alignment up to the next power of two, like glibc
+	if (alignment > SIZE_MAX / 2)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	size_t align = ALIGNMENT;
+	while (align < alignment)
+		align <<= 1;
+
+	// every block is aligned to ALIGNMENT anyway
+	if (align == ALIGNMENT)
+		return _malloc(size);
+
+	if (align > MAX_REQUEST || size > MAX_REQUEST - align)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size_t length = ALIGN(size);
+	if (length < (size_t)MIN_HEADER_SIZE)
+		length = MIN_HEADER_SIZE;
+
+	if (length + align >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+		return mmapMemalign(align, length);
+
+	arena *ar = getThreadCache()->arena;
+
+	lockArena(ar);
+	void *ptr = heapMemalign(ar, align, length);
+	unlockArena(ar);
+
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
+void *_aligned_alloc(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return _memalign(alignment, size);
+}
+
+int _posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (!alignment || alignment % sizeof(void *) ||
+	    (alignment & (alignment - 1)))
+		return EINVAL;
+
+	void *ptr = _memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+// Bytes the caller may use, at least what it asked for
+size_t _malloc_usable_size(void *ptr)
+{
+	if (!ptr)
+		return 0;
+
+	if (isSlabPointer(ptr))
+		return slabOf(ptr)->obj_size;
+
+	return blockSize((struct block_header *)ptr - 1);
+}
+
+// Snapshot of the allocator's counters, takes each arena lock in turn
+mem_stats _mallinfo(void)
+{
+	mem_stats stats = {0};
+
+	stats.mapped = __atomic_load_n(&stat_mapped, __ATOMIC_RELAXED);
+	stats.in_use = __atomic_load_n(&stat_large, __ATOMIC_RELAXED);
+	stats.peak_in_use = __atomic_load_n(&stat_large_peak, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < num_arenas; i++)
+	{
+		arena *ar = &arenas[i];
+		lockArena(ar);
+
+		stats.in_use += ar->in_use;
+		stats.peak_in_use += ar->peak_in_use;
+		stats.free_bytes += ar->free_bytes;
+		for (int bin = 0; bin < NUM_BINS; bin++)
+		{
+			stats.bin_blocks[bin] += ar->free_blocks[bin];
+			stats.free_blocks += ar->free_blocks[bin];
+		}
+
+		// the largest block sits in the highest non-empty list
+		int last = lastFreeList(ar);
+		if (last >= 0)
+		{
+			int count;
+			struct block_header **lists = freeLists(ar, &count);
+			for (struct block_header *block = lists[last]; block;
+			     block = LINKS(block)->next_free)
+			{
+				if (blockSize(block) > stats.largest_free)
+					stats.largest_free = blockSize(block);
+			}
+		}
+
+		unlockArena(ar);
+	}
+
+	if (stats.free_bytes)
+		stats.fragmentation =
+		    1.0 - (double)stats.largest_free / (double)stats.free_bytes;
+
+	return stats;
+}
+
+mem_latency _latency(int op)
+{
+	mem_latency lat = {0};
+	if (op < 0 || op >= MEM_LAT_OPS)
+		return lat;
+
+	uint64_t counts[LAT_BUCKETS] = {0};
+	uint64_t total_ns = 0;
+
+	for (latency_hist *hist = __atomic_load_n(&latency_list, __ATOMIC_ACQUIRE);
+	     hist; hist = hist->next)
+	{
+		for (int i = 0; i < LAT_BUCKETS; i++)
+			counts[i] += __atomic_load_n(&hist->buckets[op][i], __ATOMIC_RELAXED);
+		total_ns += __atomic_load_n(&hist->total_ns[op], __ATOMIC_RELAXED);
+
+		uint64_t max_ns = __atomic_load_n(&hist->max_ns[op], __ATOMIC_RELAXED);
+		if (max_ns > lat.max_ns)
+			lat.max_ns = max_ns;
+	}
+
+	for (int i = 0; i < LAT_BUCKETS; i++)
+		lat.count += counts[i];
+	if (!lat.count)
+		return lat;
+
+	lat.mean_ns = (double)total_ns / (double)lat.count;
+
+	// the first bucket that reaches each rank, reported by its upper bound
+	const double ranks[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+	uint64_t *values[] = {&lat.p50_ns, &lat.p90_ns, &lat.p99_ns, &lat.p999_ns,
+	                      &lat.p9999_ns};
+	uint64_t seen = 0;
+	int next = 0;
+
+	for (int i = 0; i < LAT_BUCKETS && next < 5; i++)
+	{
+		seen += counts[i];
+		while (next < 5 && seen >= (uint64_t)(ranks[next] * lat.count + 0.5))
+		{
+			uint64_t bound = latencyBucketMax(i);
+			*values[next++] = bound < lat.max_ns ? bound : lat.max_ns;
+		}
+	}
+
+	return lat;
+}
+
+void _latency_print(FILE *out)
+{
+#ifndef MEM_LATENCY
+	fprintf(out, "latency histograms are off, build with -DMEM_LATENCY\n");
+#else
+	static const char *names[MEM_LAT_OPS] = {"_malloc", "_free", "_calloc",
+	                                         "_realloc"};
+
+	fprintf(out, "%-10s %12s %9s %9s %9s %9s %9s %9s %9s\n", "ns", "calls",
+	        "mean", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+	for (int op = 0; op < MEM_LAT_OPS; op++)
+	{
+		mem_latency lat = _latency(op);
+		if (!lat.count)
+			continue;
+
+		fprintf(out,
+		        "%-10s %12llu %9.1f %9llu %9llu %9llu %9llu %9llu %9llu\n",
+		        names[op], (unsigned long long)lat.count, lat.mean_ns,
+		        (unsigned long long)lat.p50_ns, (unsigned long long)lat.p90_ns,
+		        (unsigned long long)lat.p99_ns, (unsigned long long)lat.p999_ns,
+		        (unsigned long long)lat.p9999_ns,
+		        (unsigned long long)lat.max_ns);
+	}
+#endif
+}
+
+void _latency_reset(void)
+{
+	for (latency_hist *hist = __atomic_load_n(&latency_list, __ATOMIC_ACQUIRE);
+	     hist; hist = hist->next)
+	{
+		for (int op = 0; op < MEM_LAT_OPS; op++)
+		{
+			for (int i = 0; i < LAT_BUCKETS; i++)
+				__atomic_store_n(&hist->buckets[op][i], 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&hist->total_ns[op], 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&hist->max_ns[op], 0, __ATOMIC_RELAXED);
+		}
+	}
+}
@@ -0,0 +1,358 @@
+// LD_PRELOAD shim: exports the standard malloc family on top of mem.c
+//
+//   LD_PRELOAD=./build/libmem_alloc.so ./program
+//
+// Every glibc allocation entry point that hands out memory has to be
+// replaced, otherwise free() would get pointers it does not own.
+//
+// With MEM_TRACE=<file> set every call is also recorded, see trace.h.
+#define _GNU_SOURCE
+
+#include "mem.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+// BOOTSTRAP
+// The allocator itself calls into libc (sysconf, pthread_once, pthread
+// keys, pthread_atfork) and some of that may allocate. Such nested calls
+// are served from a static buffer that is never freed.
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+static char bootstrap_heap[BOOTSTRAP_SIZE] __attribute__((aligned(ALIGNMENT)));
+static size_t bootstrap_top = 0;
+
+// set while this thread is inside the allocator
+static _Thread_local bool in_allocator = false;
+
+static bool isBootstrap(void *ptr)
+{
+	return (char *)ptr >= bootstrap_heap &&
+	       (char *)ptr < bootstrap_heap + BOOTSTRAP_SIZE;
+}
+
+// Each chunk keeps its size in the word in front of it for realloc
+static void *bootstrapAlloc(size_t size, size_t alignment)
+{
+	if (alignment > BOOTSTRAP_SIZE)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// like _memalign: at least ALIGNMENT, otherwise the next power of two
+	size_t align = ALIGNMENT;
+	while (align < alignment)
+		align <<= 1;
+	alignment = align;
+
+	size_t top = __atomic_load_n(&bootstrap_top, __ATOMIC_RELAXED);
+	size_t start;
+	do
+	{
+		start = (top + sizeof(size_t) + alignment - 1) & ~(alignment - 1);
+		if (start > BOOTSTRAP_SIZE || size > BOOTSTRAP_SIZE - start)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&bootstrap_top, &top,
+	                                      ALIGN(start + size), true,
+	                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	((size_t *)(bootstrap_heap + start))[-1] = size;
+	return bootstrap_heap + start;
+}
+
+static size_t bootstrapSize(void *ptr) { return ((size_t *)ptr)[-1]; }
+
+// Helper: run an allocator call unless we are already inside one
+#define ENTER(nested)                                                          \
+	if (in_allocator)                                                          \
+		return nested;                                                         \
+	in_allocator = true
+
+#define LEAVE(result)                                                          \
+	do                                                                         \
+	{                                                                          \
+		in_allocator = false;                                                  \
+		return result;                                                         \
+	} while (0)
+
+// TRACING
+// Started on the first call when MEM_TRACE is set. The trace lock is held
+// from before the allocator runs until the record is buffered, so calls are
+// serialized and the records come out in the order blocks changed hands.
+// Frees nested in the allocator's own libc calls are not recorded.
+#define TRACE_BUFFER 4096 // records written at a time
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool tracing = false;
+static int trace_fd = -1;
+static uint64_t trace_start;
+static trace_record trace_buffer[TRACE_BUFFER];
+static size_t trace_count = 0;
+static _Thread_local uint32_t trace_tid = 0;
+
+static uint64_t traceClock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Helper: write size bytes, gives up on the trace after an error
+static void traceWrite(const void *data, size_t size)
+{
+	while (size && trace_fd >= 0)
+	{
+		ssize_t written = write(trace_fd, data, size);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("[ERROR] MEM_TRACE write failed");
+			close(trace_fd);
+			trace_fd = -1;
+			return;
+		}
+		data = (const char *)data + written;
+		size -= (size_t)written;
+	}
+}
+
+// Helper: write out the buffered records, the caller holds trace_lock
+static void traceDrain(void)
+{
+	traceWrite(trace_buffer, trace_count * sizeof(trace_record));
+	trace_count = 0;
+}
+
+static void traceFlush(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	traceDrain();
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void tracePrepare(void) { pthread_mutex_lock(&trace_lock); }
+static void traceParent(void) { pthread_mutex_unlock(&trace_lock); }
+
+// the child would write the parent's records again, it is not traced
+static void traceChild(void)
+{
+	tracing = false;
+	trace_count = 0;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void initTrace(void)
+{
+	const char *path = getenv("MEM_TRACE");
+	if (!path || !*path)
+		return;
+
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace_fd < 0)
+	{
+		perror("[ERROR] MEM_TRACE open failed");
+		return;
+	}
+
+	trace_header header = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record)};
+	traceWrite(&header, sizeof(header));
+
+	trace_start = traceClock();
+	atexit(traceFlush);
+
+	// traced calls take trace_lock before an arena lock, so fork must too.
+	// Prepare handlers run in reverse order of registration: set up the
+	// arenas, which registers theirs, before registering ours.
+	_free(_malloc(1));
+	pthread_atfork(tracePrepare, traceParent, traceChild);
+	tracing = true;
+}
+
+// Helper: called inside the allocator before the real call, returns true
+// if the call is traced and traceEnd must follow
+static bool traceBegin(void)
+{
+	pthread_once(&trace_once, initTrace);
+	if (!tracing)
+		return false;
+
+	pthread_mutex_lock(&trace_lock);
+	return true;
+}
+
+static void traceEnd(uint32_t op, uint64_t arg, size_t size, void *result)
+{
+	if (!trace_tid)
+		trace_tid = (uint32_t)syscall(SYS_gettid);
+
+	trace_buffer[trace_count++] = (trace_record){
+	    .time_ns = traceClock() - trace_start,
+	    .arg = arg,
+	    .size = size,
+	    .result = (uint64_t)(uintptr_t)result,
+	    .tid = trace_tid,
+	    .op = op,
+	};
+
+	if (trace_count == TRACE_BUFFER)
+		traceDrain();
+
+	pthread_mutex_unlock(&trace_lock);
+}
+
+MEM_EXPORT void *malloc(size_t size)
+{
+	ENTER(bootstrapAlloc(size, ALIGNMENT));
+	bool traced = traceBegin();
+	void *ptr = _malloc(size);
+	if (traced)
+		traceEnd(TRACE_MALLOC, 0, size, ptr);
+	LEAVE(ptr);
+}
+
+MEM_EXPORT void free(void *ptr)
+{
+	if (!ptr || isBootstrap(ptr))
+		return;
+
+	// a nested free only happens for memory we handed out, take it
+	bool nested = in_allocator;
+	in_allocator = true;
+	bool traced = !nested && traceBegin();
+	_free(ptr);
+	if (traced)
+		traceEnd(TRACE_FREE, (uintptr_t)ptr, 0, NULL);
+	in_allocator = nested;
+}
+
+MEM_EXPORT void *calloc(size_t num, size_t size)
+{
+	// the bootstrap buffer is static, so still zero
+	size_t total;
+	if (__builtin_mul_overflow(num, size, &total))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ENTER(bootstrapAlloc(total, ALIGNMENT));
+	bool traced = traceBegin();
+	void *ptr = _calloc(num, size);
+	if (traced)
+		traceEnd(TRACE_CALLOC, 0, total, ptr);
+	LEAVE(ptr);
+}
+
+MEM_EXPORT void *realloc(void *ptr, size_t size)
+{
+	if (ptr && isBootstrap(ptr))
+	{
+		// move it onto the real heap
+		void *new_ptr = malloc(size);
+		if (new_ptr)
+		{
+			size_t old = bootstrapSize(ptr);
+			memcpy(new_ptr, ptr, old < size ? old : size);
+		}
+		return new_ptr;
+	}
+
+	ENTER(NULL);
+	bool traced = traceBegin();
+	void *new_ptr = _realloc(ptr, size);
+	if (traced)
+		traceEnd(TRACE_REALLOC, (uintptr_t)ptr, size, new_ptr);
+	LEAVE(new_ptr);
+}
+
+MEM_EXPORT void *reallocarray(void *ptr, size_t num, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(num, size, &total))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return realloc(ptr, total);
+}
+
+MEM_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (!alignment || alignment % sizeof(void *) ||
+	    (alignment & (alignment - 1)))
+		return EINVAL;
+
+	if (in_allocator)
+	{
+		void *ptr = bootstrapAlloc(size, alignment);
+		if (!ptr)
+			return ENOMEM;
+		*memptr = ptr;
+		return 0;
+	}
+
+	in_allocator = true;
+	bool traced = traceBegin();
+	int ret = _posix_memalign(memptr, alignment, size);
+	if (traced)
+		traceEnd(TRACE_MEMALIGN, alignment, size, ret ? NULL : *memptr);
+	LEAVE(ret);
+}
+
+MEM_EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+	ENTER(bootstrapAlloc(size, alignment));
+	bool traced = traceBegin();
+	void *ptr = _aligned_alloc(alignment, size);
+	if (traced)
+		traceEnd(TRACE_MEMALIGN, alignment, size, ptr);
+	LEAVE(ptr);
+}
+
+MEM_EXPORT void *memalign(size_t alignment, size_t size)
+{
+	ENTER(bootstrapAlloc(size, alignment));
+	bool traced = traceBegin();
+	void *ptr = _memalign(alignment, size);
+	if (traced)
+		traceEnd(TRACE_MEMALIGN, alignment, size, ptr);
+	LEAVE(ptr);
+}
+
+MEM_EXPORT void *valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+MEM_EXPORT void *pvalloc(size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	if (size > MAX_REQUEST)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+MEM_EXPORT size_t malloc_usable_size(void *ptr)
+{
+	if (ptr && isBootstrap(ptr))
+		return bootstrapSize(ptr);
+
+	return _malloc_usable_size(ptr);
+}
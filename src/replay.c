@@ -0,0 +1,304 @@
+// Replays an allocation trace recorded with MEM_TRACE (see trace.h) against
+// _malloc or the system malloc and reports time, peak RSS and fragmentation.
+//
+// usage: replay [--system] trace_file
+//
+// The records are replayed in order on a single thread, the pointers of the
+// trace are mapped to the ones the allocator hands out now. Every page of a
+// new block is touched, as the program that was traced would have done, so
+// the RSS figures are comparable between allocators.
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mem.h"
+#include "trace.h"
+
+typedef struct
+{
+	const char *name;
+	void *(*malloc)(size_t);
+	void (*free)(void *);
+	void *(*calloc)(size_t, size_t);
+	void *(*realloc)(void *, size_t);
+	void *(*memalign)(size_t, size_t);
+} allocator;
+
+static const allocator custom_allocator = {"custom",  _malloc,  _free,
+                                           _calloc,   _realloc, _memalign};
+static const allocator system_allocator = {"system", malloc,  free,
+                                           calloc,   realloc, memalign};
+
+// traced pointer -> live block, open addressing with linear probing. It is
+// mapped directly so neither allocator under test serves it.
+typedef struct
+{
+	uint64_t traced; // 0 = empty, TOMBSTONE = deleted
+	void *ptr;
+	size_t size;
+} live_block;
+
+#define TOMBSTONE UINT64_MAX
+#define MAX_THREADS 1024 // distinct thread ids counted for the summary
+
+static live_block *live;
+static size_t live_mask;
+
+static size_t hashPointer(uint64_t traced)
+{
+	return (size_t)((traced >> 4) * 0x9E3779B97F4A7C15ULL) & live_mask;
+}
+
+static live_block *findLive(uint64_t traced)
+{
+	for (size_t i = hashPointer(traced);; i = (i + 1) & live_mask)
+	{
+		if (live[i].traced == traced)
+			return &live[i];
+		if (!live[i].traced)
+			return NULL;
+	}
+}
+
+static void insertLive(uint64_t traced, void *ptr, size_t size)
+{
+	size_t i = hashPointer(traced);
+	while (live[i].traced && live[i].traced != TOMBSTONE)
+		i = (i + 1) & live_mask;
+
+	live[i] = (live_block){traced, ptr, size};
+}
+
+// Helper: read a counter like VmHWM from /proc/self/status, in KB
+static long procStatus(const char *key)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (!f)
+		return -1;
+
+	char line[256];
+	long value = -1;
+	size_t len = strlen(key);
+	while (fgets(line, sizeof(line), f))
+	{
+		if (!strncmp(line, key, len) && line[len] == ':')
+		{
+			value = atol(line + len + 1);
+			break;
+		}
+	}
+
+	fclose(f);
+	return value;
+}
+
+// Helper: reset VmHWM to the current RSS, so the peak only covers the replay
+static void resetPeakRss(void)
+{
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd < 0)
+		return;
+	if (write(fd, "5", 1) != 1)
+		perror("[WARN] clear_refs");
+	close(fd);
+}
+
+// Helper: write a byte to every page of a new block
+static void touch(void *ptr, size_t size)
+{
+	for (size_t i = 0; i < size; i += 4096)
+		((volatile char *)ptr)[i] = 1;
+}
+
+static double nowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	const allocator *al = &custom_allocator;
+	const char *path = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--system"))
+			al = &system_allocator;
+		else
+			path = argv[i];
+	}
+
+	if (!path)
+	{
+		fprintf(stderr, "usage: %s [--system] trace_file\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		perror(path);
+		return 1;
+	}
+
+	const trace_header *header = NULL;
+	if ((size_t)st.st_size >= sizeof(trace_header))
+		header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+		              fd, 0);
+	close(fd);
+
+	if (!header || header == MAP_FAILED || header->magic != TRACE_MAGIC ||
+	    header->version != TRACE_VERSION ||
+	    header->record_size != sizeof(trace_record))
+	{
+		fprintf(stderr, "[ERROR] %s is not a version %d trace\n", path,
+		        TRACE_VERSION);
+		return 1;
+	}
+
+	const trace_record *records = (const trace_record *)(header + 1);
+	size_t count = (st.st_size - sizeof(trace_header)) / sizeof(trace_record);
+
+	// at most one live block per allocating record, keep the table half
+	// empty
+	size_t capacity = 16;
+	while (capacity < 2 * count)
+		capacity *= 2;
+	live_mask = capacity - 1;
+	live = mmap(NULL, capacity * sizeof(live_block), PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (live == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	uint32_t threads[MAX_THREADS];
+	int num_threads = 0;
+	for (size_t i = 0; i < count && num_threads < MAX_THREADS; i++)
+	{
+		bool seen = false;
+		for (int t = 0; t < num_threads && !seen; t++)
+			seen = threads[t] == records[i].tid;
+		if (!seen)
+			threads[num_threads++] = records[i].tid;
+	}
+
+	long base_rss = procStatus("VmRSS");
+	resetPeakRss();
+
+	size_t live_bytes = 0, peak_live = 0, skipped = 0;
+
+	double start = nowMs();
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const trace_record *r = &records[i];
+		live_block *old = NULL;
+		void *ptr = NULL;
+
+		if (r->op == TRACE_FREE || (r->op == TRACE_REALLOC && r->arg))
+		{
+			// freed before we saw it allocated: from before the trace
+			old = findLive(r->arg);
+			if (!old)
+			{
+				skipped++;
+				continue;
+			}
+		}
+
+		switch (r->op)
+		{
+		case TRACE_MALLOC:
+			ptr = al->malloc(r->size);
+			break;
+		case TRACE_CALLOC:
+			ptr = al->calloc(1, r->size);
+			break;
+		case TRACE_MEMALIGN:
+			ptr = al->memalign(r->arg, r->size);
+			break;
+		case TRACE_REALLOC:
+			ptr = al->realloc(old ? old->ptr : NULL, r->size);
+			// a failed realloc keeps the old block
+			if (old && (ptr || !r->size))
+			{
+				live_bytes -= old->size;
+				old->traced = TOMBSTONE;
+			}
+			break;
+		case TRACE_FREE:
+			al->free(old->ptr);
+			live_bytes -= old->size;
+			old->traced = TOMBSTONE;
+			break;
+		default:
+			fprintf(stderr, "[ERROR] bad record %zu (op %u)\n", i, r->op);
+			return 1;
+		}
+
+		if (r->result && ptr)
+		{
+			touch(ptr, r->size);
+			insertLive(r->result, ptr, r->size);
+			live_bytes += r->size;
+			if (live_bytes > peak_live)
+				peak_live = live_bytes;
+		}
+		else if (ptr)
+		{
+			// failed when traced, do not keep it either
+			al->free(ptr);
+		}
+	}
+
+	double elapsed = nowMs() - start;
+	long peak_rss = procStatus("VmHWM");
+
+	printf("Trace:        %s, %zu calls from %d%s threads over %.1f ms\n",
+	       path, count, num_threads, num_threads == MAX_THREADS ? "+" : "",
+	       count ? records[count - 1].time_ns / 1e6 : 0.0);
+	if (skipped)
+		printf("              %zu frees of blocks from before the trace "
+		       "skipped\n",
+		       skipped);
+	printf("Allocator:    %s\n", al->name);
+	printf("Elapsed:      %.2f ms\n", elapsed);
+	printf("Peak live:    %.2f MB requested\n", peak_live / 1048576.0);
+	printf("Peak RSS:     %.2f MB above a %.2f MB baseline\n",
+	       (peak_rss - base_rss) / 1024.0, base_rss / 1024.0);
+
+	// fragmentation of what is still live at the end of the trace
+	if (al == &custom_allocator)
+	{
+		mem_stats stats = _mallinfo();
+		printf("At the end:   %.2f MB live, %.2f MB mapped, %.2f MB in free "
+		       "blocks, fragmentation %.3f\n",
+		       live_bytes / 1048576.0, stats.mapped / 1048576.0,
+		       stats.free_bytes / 1048576.0, stats.fragmentation);
+	}
+	else
+	{
+		struct mallinfo2 info = mallinfo2();
+		printf("At the end:   %.2f MB live, %.2f MB mapped, %.2f MB in free "
+		       "blocks\n",
+		       live_bytes / 1048576.0, (info.arena + info.hblkhd) / 1048576.0,
+		       info.fordblks / 1048576.0);
+	}
+
+	return 0;
+}
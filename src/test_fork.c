@@ -0,0 +1,91 @@
+// Fork under load: worker threads malloc and free through whatever malloc
+// the program is linked or preloaded with while the main thread forks, the
+// children allocate too. A lock ordering bug between the allocator's fork
+// handlers and its callers shows up as a hang.
+//
+// usage: test_fork [num_threads] [num_forks]
+//
+//   make test-fork (traced, through the preload library)
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define NUM_THREADS 4
+#define NUM_FORKS 200
+
+static bool stop = false;
+
+static void *worker(void *arg)
+{
+	unsigned int seed = (unsigned int)(size_t)arg;
+	void *window[64] = {0};
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+	{
+		int slot = rand_r(&seed) % 64;
+		free(window[slot]);
+		window[slot] = malloc(16 + rand_r(&seed) % 4096);
+		if (window[slot])
+			memset(window[slot], 1, 16);
+	}
+
+	for (int i = 0; i < 64; i++)
+		free(window[i]);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int num_threads = argc > 1 ? atoi(argv[1]) : NUM_THREADS;
+	int num_forks = argc > 2 ? atoi(argv[2]) : NUM_FORKS;
+	if (num_threads < 1 || num_threads > MAX_THREADS)
+		num_threads = NUM_THREADS;
+
+	pthread_t threads[MAX_THREADS];
+	for (int i = 0; i < num_threads; i++)
+	{
+		if (pthread_create(&threads[i], NULL, worker, (void *)(size_t)i) != 0)
+		{
+			perror("pthread_create failed");
+			return 1;
+		}
+	}
+
+	int failed = 0;
+	for (int i = 0; i < num_forks; i++)
+	{
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			perror("fork failed");
+			failed++;
+			break;
+		}
+
+		if (pid == 0)
+		{
+			// only this thread exists in the child, its heap must be usable
+			for (int j = 0; j < 1000; j++)
+				free(malloc(16 + j));
+			_exit(0);
+		}
+
+		int status;
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0)
+			failed++;
+	}
+
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("%d forks with %d threads allocating, %d failed\n", num_forks,
+	       num_threads, failed);
+	return failed != 0;
+}
@@ -1,24 +1,29 @@
 // AI GENERATED
 // ==============================================================================================================================
 
+#define _GNU_SOURCE
+
 #include "mem.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
+#define MAX_THREADS 64
 #define NUM_THREADS 4
-#define NUM_ITERATIONS 1000
+#define NUM_ITERATIONS 200000
 
 void *thread_func(void *arg)
 {
 	int id = *(int *)arg;
+	unsigned int seed = id;
 	printf("Thread %d starting...\n", id);
 
 	for (int i = 0; i < NUM_ITERATIONS; i++)
 	{
-		// Allocate a random size
-		size_t size = (rand() % 128) + 16;
+		// Allocate a random size (rand() takes a lock, use rand_r)
+		size_t size = (rand_r(&seed) % 128) + 16;
 		void *ptr = _malloc(size);
 
 		if (!ptr)
@@ -31,7 +36,7 @@ void *thread_func(void *arg)
 		*(int *)ptr = id;
 
 		// Small delay to increase chance of race condition
-		if (i % 100 == 0)
+		if (i % 10000 == 0)
 			usleep(1);
 
 		// Verify content
@@ -50,17 +55,23 @@ void *thread_func(void *arg)
 	return NULL;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-	pthread_t threads[NUM_THREADS];
-	int thread_ids[NUM_THREADS];
+	pthread_t threads[MAX_THREADS];
+	int thread_ids[MAX_THREADS];
+
+	// usage: test_threads [num_threads]
+	int num_threads = argc > 1 ? atoi(argv[1]) : NUM_THREADS;
+	if (num_threads < 1 || num_threads > MAX_THREADS)
+		num_threads = NUM_THREADS;
 
 	printf("Starting multi-threaded stress test with %d threads...\n",
-	       NUM_THREADS);
-	printf(
-	    "Expect crashes (segfaults) or corruption due to lack of mutexes.\n");
+	       num_threads);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	for (int i = 0; i < NUM_THREADS; i++)
+	for (int i = 0; i < num_threads; i++)
 	{
 		thread_ids[i] = i;
 		if (pthread_create(&threads[i], NULL, thread_func, &thread_ids[i]) != 0)
@@ -70,11 +81,19 @@ int main()
 		}
 	}
 
-	for (int i = 0; i < NUM_THREADS; i++)
+	for (int i = 0; i < num_threads; i++)
 	{
 		pthread_join(threads[i], NULL);
 	}
 
-	printf("Test finished (surprisingly without crashing if you see this).\n");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs =
+	    (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double ops = 2.0 * NUM_ITERATIONS * num_threads; // malloc + free
+
+	printf("%d threads: %.3f s, %.2f Mops/s (%.2f Mops/s per thread)\n",
+	       num_threads, secs, ops / secs / 1e6, ops / secs / 1e6 / num_threads);
+
+	printf("Test finished, any corruption is reported above.\n");
 	return 0;
 }